@@ -0,0 +1,51 @@
+/*
+ * Buddy Allocator Snapshot Format
+ *
+ * Shared between the buddy page allocator (which writes snapshots) and the
+ * buddy-snapshot host tool (which reads them).  Users of this header must
+ * already have uint64_t and uint32_t available.
+ */
+#pragma once
+
+// Identifies a buddy allocator snapshot ("BUDDYSNP"), and the layout version of the snapshot.
+#define BUDDY_SNAPSHOT_MAGIC	0x504e535944445542ULL
+#define BUDDY_SNAPSHOT_VERSION	1
+
+// The largest order a snapshot can hold counters for.
+#define BUDDY_SNAPSHOT_MAX_ORDER	31
+
+/**
+ * The header at the start of a snapshot.  It is followed by nr_runs runs, sorted by order (and then
+ * by address, if the allocator keeps its free lists sorted).
+ */
+struct BuddySnapshotHeader
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t max_order;
+
+	// a caller-chosen value (e.g. a timestamp), to tell snapshots apart
+	uint64_t tag;
+
+	// the number of pages covered by the memory map
+	uint64_t nr_page_descriptors;
+
+	// the number of pages held in the huge and gigantic page pools
+	uint64_t huge_pool_pages;
+	uint64_t gigantic_pool_pages;
+
+	// the number of free blocks in each order
+	uint64_t nr_free[BUDDY_SNAPSHOT_MAX_ORDER + 1];
+
+	uint64_t nr_runs;
+};
+
+/**
+ * A run of free blocks of the same order, each directly following the last in memory.
+ */
+struct BuddySnapshotRun
+{
+	uint64_t start_pfn;
+	uint32_t order;
+	uint32_t length;
+};
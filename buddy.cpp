@@ -10,367 +10,3298 @@
 #include <infos/util/math.h>
 #include <infos/util/printf.h>
 
+#include "buddy-snapshot.h"
+
 using namespace infos::kernel;
 using namespace infos::mm;
 using namespace infos::util;
 
-#define MAX_ORDER	18
+#define MAX_ORDER	18
+
+// Huge pages are 2 MiB, i.e. order-9 blocks of 4 KiB pages.
+#define HUGE_PAGE_ORDER	9
+
+// The number of huge pages the huge-page pool tries to keep in reserve, unless
+// changed at runtime with set_huge_pool_size().
+#define DEFAULT_HUGE_POOL_SIZE	0
+
+// Gigantic pages are 1 GiB, i.e. order-18 blocks of 4 KiB pages.  This may be larger than
+// MAX_ORDER, in which case gigantic pages are carved out of runs of contiguous max-order blocks.
+#define GIGANTIC_PAGE_ORDER	18
+
+// The number of gigantic pages reserved at boot, as memory is inserted.  More can be reserved
+// at runtime with set_gigantic_pool_size().
+#define BOOT_GIGANTIC_PAGES	0
+
+// The size of a cache line.  Allocator state that is written independently is kept on separate
+// cache lines, so that CPUs working on different parts of it do not false-share.
+#define CACHE_LINE_SIZE	64
+
+// The smallest order that ShuffledFreeList shuffles (4 MiB blocks).  Smaller blocks are handed out
+// too often for their order to matter to memory-side caches.
+#define SHUFFLE_ORDER	10
+
+// The smallest order of free block that inflate() takes from the free lists.  Smaller free blocks are
+// left alone for ordinary allocations.
+#define BALLOON_MIN_ORDER	HUGE_PAGE_ORDER
+
+// The number of queued deferred frees at which the next allocation drains the queue.
+#define DEFERRED_FREE_BATCH	64
+
+// The most CPUs that can have per-CPU page caches.
+#define NR_CPUS	64
+
+// Marks a page that did not come from a per-CPU page cache, in the page owner table.
+#define NO_OWNER_CPU	0xff
+
+// The number of pages a per-CPU page cache starts out holding before it gives some back, and the number
+// of pages it moves to or from the buddy lists at a time.  Both adapt to how busy the CPU is, with the
+// batch kept at a quarter of the high watermark.
+#define PCP_HIGH	64
+#define PCP_BATCH	16
+
+// The range the high watermark of a per-CPU page cache adapts within.
+#define PCP_MIN_HIGH	8
+#define PCP_MAX_HIGH	1024
+
+// The length of the epochs over which a per-CPU page cache measures its allocation and free rate, in
+// cycles (a few milliseconds).
+#define PCP_TUNE_CYCLES	(1ULL << 24)
+
+// The number of batches moved to or from the buddy lists in an epoch at which a cache is too small.
+#define PCP_BUSY_BATCHES	4
+
+// The number of pages waiting in a CPU's remote-free inbox at which its next free drains the inbox.
+#define REMOTE_FREE_BATCH	32
+
+// The size of a page, in bytes.
+#define BYTES_PER_PAGE	0x1000
+
+// The number of free pages held back for high-priority allocations, unless changed at runtime
+// with set_reserve_pages().
+#define DEFAULT_RESERVE_PAGES	0
+
+// Per-page state.  The low bits hold an order, and the kind bits say what the page is part of.
+#define PAGE_STATE_ORDER_MASK	0x1f
+#define PAGE_STATE_KIND_MASK	0x60
+
+// The first page of an allocated block.  The order bits hold the order of the block.
+#define PAGE_STATE_HEAD	0x20
+
+// Any other page of an allocated block.
+#define PAGE_STATE_TAIL	0x40
+
+// The first page of an allocated block that has been partly freed, and is no longer a whole block of
+// any order.  No real block has an order this large.
+#define PAGE_STATE_PARTIAL	(PAGE_STATE_HEAD | PAGE_STATE_ORDER_MASK)
+
+// The first page of a block on a free list.  The order bits hold the order of the free list.
+#define PAGE_STATE_FREE	0x60
+
+// Set alongside PAGE_STATE_FREE once the free block has been reported to the hypervisor.
+#define PAGE_STATE_REPORTED	0x80
+
+// The smallest order of free block that free page reporting hands to the hypervisor, unless changed
+// with set_reporting_backend().  Smaller blocks are reallocated too soon to be worth reporting.
+#define DEFAULT_REPORTING_ORDER	HUGE_PAGE_ORDER
+
+// Identifies a region holding saved allocator state ("BUDDYSAV"), and the layout version of that state.
+#define SAVED_STATE_MAGIC	0x5641535944445542ULL
+#define SAVED_STATE_VERSION	3
+
+static_assert(MAX_ORDER <= BUDDY_SNAPSHOT_MAX_ORDER, "snapshots cannot describe every order");
+
+/**
+ * Placement policies, which decide which free block allocate_pages() splits when the smallest
+ * non-empty order holds more than one.
+ */
+namespace PlacementPolicy
+{
+	enum PlacementPolicy
+	{
+		// Take the block at the head of the free list, in O(1): the lowest address for a sorted free
+		// list, the most recently freed block for a LIFO one, and a random one for a shuffled one.
+		LIST_HEAD,
+
+		// Take the block with the lowest address, i.e. the head of a sorted free list.  An unsorted
+		// free list has to be searched.
+		LOWEST_ADDRESS,
+
+		// Take the block with the highest address, i.e. the tail of a sorted free list.
+		HIGHEST_ADDRESS,
+
+		// Prefer a block whose buddy is fully allocated, so that partially free buddies get
+		// a chance to coalesce.
+		BUDDY_ALLOCATED,
+	};
+}
+
+/**
+ * The state of a single order: the head of its free list, the number of blocks on it, and how many of
+ * those have been reported to the hypervisor.  Each order gets a cache line to itself, so that frees
+ * and allocations at different orders never write to the same free-area line.  (They all still write
+ * the allocator-wide totals, which are kept on a line of their own.)
+ */
+struct FreeArea
+{
+	PageDescriptor *free_list;
+	uint64_t nr_free;
+	uint64_t nr_reported;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static_assert(sizeof(FreeArea) == CACHE_LINE_SIZE, "free areas must not share cache lines");
+static_assert(NR_CPUS < NO_OWNER_CPU, "the page owner table cannot name every CPU");
+
+/**
+ * A per-CPU cache of single pages, so that most order-0 allocations and frees never touch the buddy
+ * lists or take the allocator lock.  The cache itself is only ever touched by its own CPU.  Other CPUs
+ * that free pages this CPU allocated push them onto its remote-free inbox (a lock-free stack, with many
+ * producers and this CPU as the only consumer), which lives on a separate cache line.
+ */
+struct PerCpuPages
+{
+	// cached pages, linked through next_free, most recently freed first
+	PageDescriptor *free_list;
+	uint64_t count;
+
+	// the number of pages held before some are given back, and the number moved at a time
+	uint64_t high;
+	uint64_t batch;
+
+	// counters, for measuring how the cache is used
+	uint64_t allocations;
+	uint64_t local_frees;
+	uint64_t remote_frees;
+	uint64_t refills;
+	uint64_t trims;
+	uint64_t inbox_drains;
+	uint64_t inbox_pages;
+
+	// the current tuning epoch: when it started, and the allocations, frees and batches seen since
+	uint64_t epoch_start;
+	uint64_t epoch_events;
+	uint64_t epoch_batches;
+
+	// counters, for measuring how the cache has been tuned
+	uint64_t grows;
+	uint64_t shrinks;
+	uint64_t idle_drains;
+
+	// pages freed by other CPUs, waiting to come back to this one
+	__attribute__((aligned(CACHE_LINE_SIZE))) PageDescriptor *inbox;
+	uint64_t inbox_depth;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * The kinds of extent recorded in saved allocator state.
+ */
+namespace SavedExtentKind
+{
+	enum SavedExtentKind
+	{
+		FREE = 0,
+		HUGE_POOL = 1,
+		GIGANTIC_POOL = 2,
+		BALLOON = 3,
+	};
+}
+
+/**
+ * The header at the start of a region holding a saved copy of the allocator's free-extent state, so
+ * that the next boot can restore it without rebuilding the free lists from the memory map.  The header
+ * is followed by nr_extents packed extents, each holding (pfn << 8) | (kind << 6) | order.
+ */
+struct SavedStateHeader
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t max_order;
+	uint64_t nr_page_descriptors;
+
+	// where the per-page state tables live, which stays allocated across the restore
+	uint64_t page_tables_pfn;
+
+	uint64_t nr_extents;
+	uint64_t checksum;
+};
+
+/**
+ * Flags that change how an allocation or free is carried out.  With no flags set, allocation and
+ * freeing behave exactly like allocate_pages() and free_pages().  InfOS has a single memory node, so
+ * there is no flag for node selection.
+ */
+namespace AllocFlags
+{
+	enum AllocFlags
+	{
+		NONE = 0,
+
+		// Never wait: fail straight away if another CPU holds the allocator lock, and never drain the
+		// deferred-free queue to satisfy the allocation.  This makes allocate_pages() safe to call from
+		// interrupt context under SpinLocking.
+		NO_WAIT = (1 << 0),
+
+		// Only hand out a block that is already of the requested order, and never split a larger one.
+		NO_SPLIT = (1 << 1),
+
+		// Zero the pages, before handing them out (or before freeing them).
+		ZERO = (1 << 2),
+
+		// Allow the allocation to use the pages held back by the reserve watermark.
+		HIGH_PRIORITY = (1 << 3),
+
+		// The pages can be moved later, so take the highest-addressed block that fits, keeping them
+		// apart from unmovable allocations (which follow the placement policy).
+		MOVABLE = (1 << 4),
+
+		// Never break up the huge-page pool (the allocator's only form of compaction) to satisfy the
+		// allocation.
+		NO_COMPACT = (1 << 5),
+
+		// Free through the deferred-free queue, rather than coalescing straight away.
+		DEFER = (1 << 6),
+	};
+}
+
+/**
+ * One entry in a scatter-gather list: a block of 2^order contiguous pages.
+ */
+struct PageExtent
+{
+	PageDescriptor *pgd;
+	int order;
+};
+
+/**
+ * A request for pages that allocate_pages_async() could not satisfy straight away.  The caller owns the
+ * request, which must stay alive until its callback has run or it has been cancelled.
+ */
+struct AllocationRequest
+{
+	// the order of the block wanted, and the allocation flags (see AllocFlags) to allocate it with
+	int order;
+	unsigned int flags;
+
+	// run with the newly allocated block once the request can be satisfied
+	void (*callback)(AllocationRequest *request, PageDescriptor *pgd);
+
+	// for the caller's use, e.g. to find what is waiting on the request
+	void *context;
+
+	// links the request into the queue of requests waiting for the same order
+	AllocationRequest *next;
+};
+
+/**
+ * A backend for free page reporting, which tells the host that the memory behind a free block can be
+ * reclaimed (e.g. through a virtio-balloon device, when running as a VM guest).  Reported blocks stay on
+ * the free lists, and may be allocated again at any time; the host faults the memory back in on demand.
+ */
+class FreePageReportingBackend
+{
+public:
+	/**
+	 * Reports a free block to the host.
+	 * @param start_pfn The page-frame number of the first page of the block.
+	 * @param nr_pages The number of pages in the block.
+	 */
+	virtual void report(pfn_t start_pfn, uint64_t nr_pages) = 0;
+};
+
+/**
+ * A stand-in reporting backend for running without a hypervisor, which only counts what it is given.
+ */
+class LocalReportingBackend : public FreePageReportingBackend
+{
+public:
+	LocalReportingBackend() : _nr_reports(0), _nr_pages(0) { }
+
+	void report(pfn_t start_pfn, uint64_t nr_pages) override
+	{
+		_nr_reports++;
+		_nr_pages += nr_pages;
+	}
+
+	/**
+	 * Returns the number of blocks reported so far.
+	 */
+	uint64_t nr_reports() const { return _nr_reports; }
+
+	/**
+	 * Returns the number of pages reported so far.
+	 */
+	uint64_t nr_pages() const { return _nr_pages; }
+
+private:
+	uint64_t _nr_reports;
+	uint64_t _nr_pages;
+};
+
+/*
+ * The buddy allocator is put together from compile-time policies, so that each configuration only
+ * contains the code it needs: a disabled feature is an empty inline call that folds away, rather than
+ * a runtime test.  The policies are:
+ *
+ *   FreeList  - how blocks are kept on the free lists (SortedFreeList, LifoFreeList, ShuffledFreeList)
+ *   Lock      - how allocator operations are serialised (NoLocking, SpinLocking)
+ *   Stats     - which allocation statistics are gathered (NoStatistics, CountingStatistics)
+ *   Placement - how the placement policy is chosen (RuntimePlacement, FixedPlacement<P>)
+ */
+
+/**
+ * Keeps each free list sorted by address.  Insertion walks the list, but the lowest-addressed block is
+ * always at the head, and neighbouring blocks sit next to each other.
+ */
+struct SortedFreeList
+{
+	static const bool sorted = true;
+
+	/**
+	 * Inserts a block into a free list, in ascending address order.
+	 * @param head The head of the free list.
+	 * @param pgd The page descriptor of the block to insert.
+	 * @param order The order of the free list.
+	 * @return Returns the slot (i.e. a pointer to the pointer that points to the block) that the block
+	 * was inserted into.
+	 */
+	static inline PageDescriptor **insert(PageDescriptor **head, PageDescriptor *pgd, int order)
+	{
+		// Iterate whilst there is a slot, and whilst the page descriptor pointer is numerically
+		// greater than what the slot is pointing to.
+		PageDescriptor **slot = head;
+		while (*slot && pgd > *slot)
+		{
+			slot = &(*slot)->next_free;
+		}
+
+		// Insert the page descriptor into the linked list.
+		pgd->next_free = *slot;
+		*slot = pgd;
+		return slot;
+	}
+
+	/**
+	 * Sorted free lists are never shuffled.
+	 */
+	static inline void shuffle(PageDescriptor **head, uint64_t count, int order) { }
+
+	/**
+	 * Splitting always keeps the lower half, so that allocations stay low in memory.
+	 */
+	static inline bool keep_upper_half(int order) { return false; }
+};
+
+/**
+ * Pushes freed blocks onto the head of each free list, in O(1).  The most recently freed (and so most
+ * likely cache-hot) block is handed out first, but finding a block by address means walking the list.
+ */
+struct LifoFreeList
+{
+	static const bool sorted = false;
+
+	/**
+	 * Inserts a block at the head of a free list.
+	 * @param head The head of the free list.
+	 * @param pgd The page descriptor of the block to insert.
+	 * @param order The order of the free list.
+	 * @return Returns the slot that the block was inserted into, i.e. the head.
+	 */
+	static inline PageDescriptor **insert(PageDescriptor **head, PageDescriptor *pgd, int order)
+	{
+		pgd->next_free = *head;
+		*head = pgd;
+		return head;
+	}
+
+	/**
+	 * LIFO free lists are never shuffled.
+	 */
+	static inline void shuffle(PageDescriptor **head, uint64_t count, int order) { }
+
+	/**
+	 * Splitting always keeps the lower half.
+	 */
+	static inline bool keep_upper_half(int order) { return false; }
+};
+
+/**
+ * Keeps the free lists of large blocks in random order, so that consecutive allocations land on
+ * addresses spread across memory-side cache sets and channels, rather than marching through memory in
+ * address order.  The lists are shuffled as memory is inserted, and large freed blocks go to the head
+ * or the tail at random (much like Linux's page_alloc shuffling).  Splitting a block keeps a random
+ * half at each order from SHUFFLE_ORDER up, so that consecutive allocations carved from the same large
+ * block are spread across it too.  Blocks below SHUFFLE_ORDER are pushed onto the head, and split, as
+ * with LifoFreeList.
+ */
+struct ShuffledFreeList
+{
+	static const bool sorted = false;
+
+	/**
+	 * Returns the next number from a xorshift generator.  This is not cryptographically random, and only
+	 * needs to break up address order.  It is only used under the allocator lock.
+	 */
+	static inline uint64_t next_random()
+	{
+		static uint64_t state = 0;
+		if (!state) state = __builtin_ia32_rdtsc() | 1;
+
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	/**
+	 * Inserts a block into a free list, at the head or (for large blocks, at random) the tail.
+	 * @param head The head of the free list.
+	 * @param pgd The page descriptor of the block to insert.
+	 * @param order The order of the free list.
+	 * @return Returns the slot that the block was inserted into.
+	 */
+	static inline PageDescriptor **insert(PageDescriptor **head, PageDescriptor *pgd, int order)
+	{
+		PageDescriptor **slot = head;
+
+		// large-block free lists are short, so walking to the tail is cheap
+		if (order >= SHUFFLE_ORDER && (next_random() & 1))
+		{
+			while (*slot)
+			{
+				slot = &(*slot)->next_free;
+			}
+		}
+
+		pgd->next_free = *slot;
+		*slot = pgd;
+		return slot;
+	}
+
+	/**
+	 * Shuffles a free list of large blocks.  Each pass deals the blocks at random into two piles and puts
+	 * one pile after the other, which is a radix sort on random keys: after enough passes to give every
+	 * block its own key (with a margin), the order is uniformly random.  This takes O(count log count)
+	 * time and no extra memory.
+	 * @param head The head of the free list.
+	 * @param count The number of blocks on the free list.
+	 * @param order The order of the free list.
+	 */
+	static void shuffle(PageDescriptor **head, uint64_t count, int order)
+	{
+		if (order < SHUFFLE_ORDER || count < 2) return;
+
+		int passes = (64 - __builtin_clzll(count)) + 8;
+		for (int pass = 0; pass < passes; pass++)
+		{
+			PageDescriptor *piles[2] = { NULL, NULL };
+			PageDescriptor **tails[2] = { &piles[0], &piles[1] };
+
+			uint64_t bits = 0;
+			int nr_bits = 0;
+			for (PageDescriptor *block = *head; block; block = block->next_free)
+			{
+				if (nr_bits == 0)
+				{
+					bits = next_random();
+					nr_bits = 64;
+				}
+
+				int pile = bits & 1;
+				bits >>= 1;
+				nr_bits--;
+
+				*tails[pile] = block;
+				tails[pile] = &block->next_free;
+			}
+
+			*tails[1] = NULL;
+			*tails[0] = piles[1];
+			*head = piles[0];
+		}
+	}
+
+	/**
+	 * Decides at random which half of a large block splitting keeps.
+	 * @param order The order of the two halves.
+	 * @return Returns TRUE if the upper half should be kept, and the lower half freed.
+	 */
+	static inline bool keep_upper_half(int order)
+	{
+		return order >= SHUFFLE_ORDER && (next_random() & 1);
+	}
+};
+
+/**
+ * No locking, for when the caller already serialises every allocator operation.
+ */
+class NoLocking
+{
+public:
+	inline void lock() { }
+	inline bool try_lock() { return true; }
+	inline void unlock() { }
+};
+
+/**
+ * A test-and-set spinlock around every allocator operation.  The deferred-free queue stays lock-free,
+ * so blocks can still be queued from contexts that must not spin.
+ */
+class SpinLocking
+{
+public:
+	SpinLocking() : _locked(false) { }
+
+	inline void lock()
+	{
+		while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE))
+		{
+			// wait for the lock to look free before trying again, so that waiters do not keep
+			// stealing the cache line from the holder
+			while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) __builtin_ia32_pause();
+		}
+	}
+
+	inline bool try_lock()
+	{
+		return !__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE);
+	}
+
+	inline void unlock()
+	{
+		__atomic_clear(&_locked, __ATOMIC_RELEASE);
+	}
+
+private:
+	bool _locked;
+};
+
+/**
+ * Holds a lock for as long as the guard is in scope.
+ */
+template<class Lock>
+class AllocatorLockGuard
+{
+public:
+	AllocatorLockGuard(Lock& lock) : _lock(lock), _held(true) { _lock.lock(); }
+
+	/**
+	 * Takes the lock, or only tries to take it if try_only is set, in which case held() says whether
+	 * the guard got it.
+	 */
+	AllocatorLockGuard(Lock& lock, bool try_only) : _lock(lock), _held(true)
+	{
+		if (try_only) _held = _lock.try_lock();
+		else _lock.lock();
+	}
+
+	~AllocatorLockGuard() { if (_held) _lock.unlock(); }
+
+	bool held() const { return _held; }
+
+private:
+	Lock& _lock;
+	bool _held;
+};
+
+/**
+ * Gathers no statistics at all.
+ */
+class NoStatistics
+{
+public:
+	inline void reset() { }
+	inline void allocated(int order, bool succeeded) { }
+	inline void freed(int order) { }
+	inline void dump() const { }
+};
+
+/**
+ * Counts allocations, failed allocations and frees, and the pages they covered.
+ */
+class CountingStatistics
+{
+public:
+	void reset()
+	{
+		_allocations = 0;
+		_failed_allocations = 0;
+		_frees = 0;
+		_pages_allocated = 0;
+		_pages_freed = 0;
+	}
+
+	inline void allocated(int order, bool succeeded)
+	{
+		if (!succeeded)
+		{
+			_failed_allocations++;
+			return;
+		}
+
+		_allocations++;
+		_pages_allocated += 1ULL << order;
+	}
+
+	inline void freed(int order)
+	{
+		_frees++;
+		_pages_freed += 1ULL << order;
+	}
+
+	void dump() const
+	{
+		mm_log.messagef(LogLevel::DEBUG, "statistics: allocations=%lu failed=%lu frees=%lu pages-allocated=%lu pages-freed=%lu",
+			_allocations, _failed_allocations, _frees, _pages_allocated, _pages_freed);
+	}
+
+private:
+	uint64_t _allocations;
+	uint64_t _failed_allocations;
+	uint64_t _frees;
+	uint64_t _pages_allocated;
+	uint64_t _pages_freed;
+};
+
+/**
+ * A placement policy that starts as LIST_HEAD (so that each free-list policy hands out blocks in its
+ * own order), and can be changed at runtime with set_placement_policy().
+ */
+class RuntimePlacement
+{
+public:
+	inline void reset() { _policy = PlacementPolicy::LIST_HEAD; }
+	inline PlacementPolicy::PlacementPolicy current() const { return _policy; }
+	inline void set(PlacementPolicy::PlacementPolicy policy) { _policy = policy; }
+
+private:
+	PlacementPolicy::PlacementPolicy _policy;
+};
+
+/**
+ * A placement policy fixed at compile time, so that the choice of block folds away.  This cannot be
+ * changed at runtime, so set_placement_policy() does not compile with it.
+ */
+template<PlacementPolicy::PlacementPolicy Policy>
+class FixedPlacement
+{
+public:
+	inline void reset() { }
+	inline PlacementPolicy::PlacementPolicy current() const { return Policy; }
+};
+
+/**
+ * A buddy page allocation algorithm, put together from a set of policies (see above).
+ */
+template<class FreeList, class Lock, class Stats, class Placement>
+class BasicBuddyPageAllocator : public PageAllocatorAlgorithm
+{
+private:
+	typedef AllocatorLockGuard<Lock> LockGuard;
+
+	/**
+	 * Returns the number of pages that comprise a 'block', in a given order.
+	 * @param order The order to base the calculation off of.
+	 * @return Returns the number of pages in a block, in the order.
+	 */
+	static inline constexpr uint64_t pages_per_block(int order)
+	{
+		/* The number of pages per block in a given order is simply 1, shifted left by the order number.
+		 * For example, in order-2, there are (1 << 2) == 4 pages in each block.  The shift is done in
+		 * 64 bits, so that orders above MAX_ORDER (i.e. gigantic pages) do not overflow.
+		 */
+		return (1ULL << order);
+	}
+
+	/**
+	 * Hints to the CPU that the given page descriptor is about to be used.  This only pays off when the
+	 * address is known well before it is needed (e.g. a buddy, which is computed rather than loaded), so
+	 * it is not used to chase next_free pointers.  Prefetching NULL is harmless.
+	 * @param pgd The page descriptor to prefetch.
+	 */
+	static inline void prefetch_descriptor(const PageDescriptor *pgd)
+	{
+		__builtin_prefetch(pgd);
+	}
+
+	/**
+	 * Returns TRUE if the supplied page descriptor is correctly aligned for the 
+	 * given order.  Returns FALSE otherwise.
+	 * @param pgd The page descriptor to test alignment for.
+	 * @param order The order to use for calculations.
+	 */
+	static inline bool is_correct_alignment_for_order(const PageDescriptor *pgd, int order)
+	{
+		// Calculate the page-frame-number for the page descriptor, and return TRUE if
+		// it divides evenly into the number pages in a block of the given order.
+		return (sys.mm().pgalloc().pgd_to_pfn(pgd) % pages_per_block(order)) == 0;
+	}
+
+	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
+	 * to the left or the right of PGD, in the given order.
+	 * @param pgd The page descriptor to find the buddy for.
+	 * @param order The order in which the page descriptor lives.
+	 * @return Returns the buddy of the given page descriptor, in the given order.
+	 */
+	PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
+	{
+        	// (1) Make sure 'order' is within range
+		if (order >= MAX_ORDER) 
+		{
+			return NULL;
+		}
+
+		// (2) Check to make sure that PGD is correctly aligned in the order
+		if (!is_correct_alignment_for_order(pgd, order)) 
+		{
+			return NULL;
+		}
+
+		// (3) Calculate the page-frame-number of the buddy of this page.
+		// * If the PFN is aligned to the next order, then the buddy is the next block in THIS order.
+		// * If it's not aligned, then the buddy must be the previous block in THIS order.
+		uint64_t buddy_pfn = is_correct_alignment_for_order(pgd, order + 1) ?
+			sys.mm().pgalloc().pgd_to_pfn(pgd) + pages_per_block(order) : 
+			sys.mm().pgalloc().pgd_to_pfn(pgd) - pages_per_block(order);
+
+		// (4) Return the page descriptor associated with the buddy page-frame-number.
+		return sys.mm().pgalloc().pfn_to_pgd(buddy_pfn);
+	}
+
+	/**
+	 * Updates the counters and per-page state after a block has been put on a free list.
+	 * @param pgd The page descriptor of the block.
+	 * @param order The order of the free list.
+	 */
+	void note_inserted(PageDescriptor *pgd, int order)
+	{
+		_page_state[sys.mm().pgalloc().pgd_to_pfn(pgd)] = PAGE_STATE_FREE | order;
+		_free_areas[order].nr_free++;
+		_nr_free_pages += pages_per_block(order);
+		_nonempty_orders |= (1U << order);
+	}
+
+	/**
+	 * Updates the counters and per-page state after a block has been taken off a free list.
+	 * @param pgd The page descriptor of the block.
+	 * @param order The order of the free list.
+	 */
+	void note_removed(PageDescriptor *pgd, int order)
+	{
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		if (_page_state[pfn] & PAGE_STATE_REPORTED) _free_areas[order].nr_reported--;
+
+		_page_state[pfn] = 0;
+		_nr_free_pages -= pages_per_block(order);
+		if (--_free_areas[order].nr_free == 0) _nonempty_orders &= ~(1U << order);
+	}
+
+	/**
+	 * Inserts a block into the free list of the given order, where the free-list policy puts it.
+	 * @param pgd The page descriptor of the block to insert.
+	 * @param order The order in which to insert the block.
+	 * @return Returns the slot (i.e. a pointer to the pointer that points to the block) that the block
+	 * was inserted into.
+	 */
+	PageDescriptor **insert_block(PageDescriptor *pgd, int order)
+	{
+		PageDescriptor **slot = FreeList::insert(&_free_areas[order].free_list, pgd, order);
+		note_inserted(pgd, order);
+
+		// Return the insert point (i.e. slot)
+		return slot;
+	}
+
+	/**
+	 * Removes a block from the free list of the given order.  The block MUST be present in the free-list, otherwise
+	 * the system will panic.
+	 * @param pgd The page descriptor of the block to remove.
+	 * @param order The order in which to remove the block from.
+	 */
+	void remove_block(PageDescriptor *pgd, int order)
+	{
+		// Starting from the _free_area array, iterate until the block has been located in the linked-list.
+		PageDescriptor **slot = &_free_areas[order].free_list;
+		while (*slot && pgd != *slot) 
+		{
+			slot = &(*slot)->next_free;
+		}
+
+		// Make sure the block actually exists.  Panic the system if it does not.
+		assert(*slot == pgd);
+
+		// Remove the block from the free list.
+		*slot = pgd->next_free;
+		pgd->next_free = NULL;
+		note_removed(pgd, order);
+	}
+
+	/**
+	 * Takes a free block off its free list, and splits it down to a smaller order.  One half is carried
+	 * down without ever being put on a free list, so each level of splitting costs a single insertion (of
+	 * the other half, which stays free) instead of two insertions and a removal.  The left-hand half is
+	 * kept, unless the free-list policy says otherwise.
+	 * @param block The block to split.  It must be on the free list of the source order.
+	 * @param source_order The order in which the block of free memory exists.
+	 * @param target_order The order of the block to hand back.
+	 * @return Returns the kept block of the target order, which is no longer on any free list.
+	 */
+	PageDescriptor *split_down(PageDescriptor *block, int source_order, int target_order)
+	{
+		// Make sure the block is correctly aligned.
+		assert(is_correct_alignment_for_order(block, source_order));
+
+		// take the whole block off its free list once
+		remove_block(block, source_order);
+
+		// and hand one half back at each order on the way down (the right-hand half, unless the free-list
+		// policy wants a spread of addresses)
+		for (int order = source_order - 1; order >= target_order; order--) 
+		{
+			if (FreeList::keep_upper_half(order)) 
+			{
+				insert_block(block, order);
+				block += pages_per_block(order);
+			}
+			else 
+			{
+				insert_block(block + pages_per_block(order), order);
+			}
+		}
+
+		return block;
+	}
+
+	/**
+	 * Removes a block from the free list of the given order, if it is there.
+	 * @param pgd The page descriptor of the block to remove.
+	 * @param order The order in which to look for the block.
+	 * @return Returns TRUE if the block was free and has been removed, or FALSE if it was not free.
+	 */
+	bool try_remove_block(PageDescriptor *pgd, int order)
+	{
+		// the per-page state says whether the block is free, so only walk the list if it is
+		if (!is_free_block(pgd, order)) return false;
+
+		remove_block(pgd, order);
+		return true;
+	}
+
+	/**
+	 * Returns TRUE if the given block is currently sitting in the free list of the given order, in O(1).
+	 * @param pgd The page descriptor of the block to look for.
+	 * @param order The order of the free list to search.
+	 */
+	bool is_free_block(const PageDescriptor *pgd, int order) const
+	{
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		return pfn < _nr_page_descriptors && (_page_state[pfn] & ~PAGE_STATE_REPORTED) == (PAGE_STATE_FREE | order);
+	}
+
+	/**
+	 * Finds the free block that contains a page, by checking the correctly aligned block at each order.
+	 * This takes O(MAX_ORDER) steps, and never walks a free list.
+	 * @param pfn The page-frame number of the page.
+	 * @param block_pfn Receives the page-frame number of the free block containing the page, if there is one.
+	 * @return Returns the order of the free block containing the page, or -1 if the page is not free.
+	 */
+	int find_free_block(pfn_t pfn, pfn_t *block_pfn) const
+	{
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			*block_pfn = pfn & ~(pages_per_block(order) - 1);
+			if (*block_pfn < _nr_page_descriptors && (_page_state[*block_pfn] & ~PAGE_STATE_REPORTED) == (PAGE_STATE_FREE | order)) return order;
+		}
+
+		return -1;
+	}
+
+	/**
+	 * Zeroes the contents of a block.
+	 * @param pgd The page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	static void zero_block(const PageDescriptor *pgd, int order)
+	{
+		__builtin_memset(sys.mm().pgalloc().pgd_to_vpa(pgd), 0, pages_per_block(order) * BYTES_PER_PAGE);
+	}
+
+	/**
+	 * Returns TRUE if an allocation of the given order may go ahead without eating into the pages held
+	 * back for high-priority allocations, either because enough pages are free or because the flags
+	 * allow it to use them.
+	 * @param order The order of the allocation.
+	 * @param flags The allocation flags (see AllocFlags).
+	 */
+	bool within_reserve(int order, unsigned int flags) const
+	{
+		return (flags & AllocFlags::HIGH_PRIORITY) || _nr_free_pages >= pages_per_block(order) + _reserve_pages;
+	}
+
+	/**
+	 * Returns TRUE if the deferred-free queue should be drained now: either a full batch has built up, or
+	 * an asynchronous allocation is waiting for memory that may be sitting on the queue.
+	 */
+	bool deferred_frees_due() const
+	{
+		uint64_t depth = __atomic_load_n(&_deferred_depth, __ATOMIC_RELAXED);
+		return depth >= DEFERRED_FREE_BATCH || (depth && __atomic_load_n(&_waiting_orders, __ATOMIC_RELAXED));
+	}
+
+	/**
+	 * Allocates 2^order contiguous pages, following a set of allocation flags.  This is always inlined,
+	 * so that when the flags are known at compile time (e.g. none at all, from allocate_pages()) every
+	 * test of them folds away.  The caller must hold the allocator lock.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param flags The allocation flags (see AllocFlags).
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	inline __attribute__((always_inline)) PageDescriptor *allocate_with_flags(int order, unsigned int flags)
+	{
+		// drain deferred frees in batches, so that the queue never grows without bound
+		if (!(flags & AllocFlags::NO_WAIT) && deferred_frees_due()) 
+		{
+			drain_deferred_frees();
+		}
+
+		PageDescriptor *block;
+
+		// blocks larger than the largest order can only be made from runs of max-order blocks
+		if (order > MAX_ORDER) 
+		{
+			block = within_reserve(order, flags) ? mark_allocated(allocate_contiguous(order), order) : NULL;
+		}
+		else 
+		{
+			uint32_t candidates;
+			for (;;) 
+			{
+				// find the smallest non-empty order that can satisfy the request, with a single bit scan, as
+				// long as it leaves the reserve alone (unless the allocation may use it)
+				candidates = _nonempty_orders & ((flags & AllocFlags::NO_SPLIT) ? (1U << order) : ~((1U << order) - 1));
+				if (candidates && within_reserve(order, flags)) break;
+
+				// drain any deferred frees before giving up
+				if (!(flags & AllocFlags::NO_WAIT) && drain_deferred_frees()) continue;
+
+				// a huge page out of the pool only helps if it would be a candidate, i.e. it can be split, or
+				// is exactly the size wanted; the pool is never given up just to get round the reserve
+				bool pool_helps = (flags & AllocFlags::NO_SPLIT) ? order == HUGE_PAGE_ORDER : order <= HUGE_PAGE_ORDER;
+				if (!candidates && !(flags & AllocFlags::NO_COMPACT) && pool_helps && release_huge_page()) continue;
+				return NULL;
+			}
+
+			int free = __builtin_ctz(candidates);
+
+			// split the block chosen by the placement policy down to the requested order
+			PlacementPolicy::PlacementPolicy policy = (flags & AllocFlags::MOVABLE) ? PlacementPolicy::HIGHEST_ADDRESS : _placement.current();
+			block = mark_allocated(split_down(choose_block(free, policy), free, order), order);
+		}
+
+		if ((flags & AllocFlags::ZERO) && block) zero_block(block, order);
+		return block;
+	}
+
+	/**
+	 * Records a block as allocated, by marking its first page as the head (holding the order of the block)
+	 * and every other page as a tail.  The block belongs to no CPU's page cache.
+	 * @param pgd The page descriptor of the block, or NULL if allocation failed.
+	 * @param order The order of the block.
+	 * @return Returns the page descriptor of the block, so that allocation paths can return it directly.
+	 */
+	PageDescriptor *mark_allocated(PageDescriptor *pgd, int order)
+	{
+		if (!pgd) return NULL;
+
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		_page_state[pfn] = PAGE_STATE_HEAD | order;
+		__builtin_memset(&_page_state[pfn + 1], PAGE_STATE_TAIL, pages_per_block(order) - 1);
+		__builtin_memset(&_page_owner[pfn], NO_OWNER_CPU, pages_per_block(order));
+
+		return pgd;
+	}
+
+	/**
+	 * Clears the per-page state of a block that is no longer allocated, including which CPU's page cache
+	 * it came from, however it was freed.
+	 * @param pgd The page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	void clear_page_state(const PageDescriptor *pgd, int order)
+	{
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		__builtin_memset(&_page_state[pfn], 0, pages_per_block(order));
+		__builtin_memset(&_page_owner[pfn], NO_OWNER_CPU, pages_per_block(order));
+	}
+
+	/**
+	 * Merges a block with its buddies for as long as they are free, and then inserts the final
+	 * coalesced block into the free lists.  Only the buddies are ever removed from a free list, and
+	 * the block itself is inserted once, at its final order.  Unlike free_pages(), this does not give
+	 * the reserve pools a chance to refill themselves.
+	 * @param pgd The page descriptor of the block to coalesce.
+	 * @param order The order of the block.
+	 */
+	void coalesce_block(PageDescriptor *pgd, int order)
+	{
+		clear_page_state(pgd, order);
+
+		// climb for as long as the buddy is sitting on the free list of the current order
+		while (order < MAX_ORDER) 
+		{
+			// the buddy is written to if it is unlinked, so start fetching it before walking the list
+			PageDescriptor *buddy = buddy_of(pgd, order);
+			prefetch_descriptor(buddy);
+			if (!try_remove_block(buddy, order)) break;
+
+			// the merged block starts at whichever of the pair comes first
+			if (buddy < pgd) pgd = buddy;
+			order++;
+		}
+
+		insert_block(pgd, order);
+	}
+
+	/**
+	 * Returns the order of the largest correctly aligned block that starts a range of pages.
+	 * @param start A pointer to the first page descriptor in the range.
+	 * @param count The number of pages in the range, which must not be zero.
+	 */
+	int largest_block_order(const PageDescriptor *start, uint64_t count) const
+	{
+		int order;
+		for (order = MAX_ORDER; order > 0; order--) 
+		{
+			// loop through all blocks until the correct range of pages is found
+			if (pages_per_block(order) <= count && is_correct_alignment_for_order(start, order)) break;
+		}
+
+		return order;
+	}
+
+	/**
+	 * Splits a range of pages into the largest correctly aligned blocks possible, and coalesces each one
+	 * into the free lists.
+	 * @param start A pointer to the first page descriptor in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void free_range(PageDescriptor *start, uint64_t count)
+	{
+		while (count > 0) 
+		{
+			int size = largest_block_order(start, count);
+
+			// free all pages for that order
+			coalesce_block(start, size);
+			// and update the start and count
+			start += pages_per_block(size);
+			count -= pages_per_block(size);
+		}
+	}
+
+	/**
+	 * Tops the huge-page pool back up to its target size, by taking order-9 blocks from the free lists.
+	 * Blocks are only taken from orders that are already large enough, so this never steals pages from
+	 * smaller allocations, and never from the pages held back for high-priority allocations.
+	 */
+	void refill_huge_pool()
+	{
+		while (_huge_pool_count < _huge_pool_target) 
+		{
+			if (!within_reserve(HUGE_PAGE_ORDER, AllocFlags::NONE)) return;
+
+			// find the smallest order that can supply a huge page without further splitting below order-9
+			int order;
+			for (order = HUGE_PAGE_ORDER; order <= MAX_ORDER; order++) 
+			{
+				if (_free_areas[order].free_list) break;
+			}
+
+			// nothing large enough is free, so the pool stays short for now
+			if (order > MAX_ORDER) return;
+
+			PageDescriptor *block = split_down(_free_areas[order].free_list, order, HUGE_PAGE_ORDER);
+			block->next_free = _huge_pool;
+			_huge_pool = block;
+			_huge_pool_count++;
+		}
+	}
+
+	/**
+	 * Takes one huge page out of the pool, and hands it back to the free lists so that it can be split
+	 * to satisfy smaller allocations.
+	 * @return Returns TRUE if a huge page was released, or FALSE if the pool was empty.
+	 */
+	bool release_huge_page()
+	{
+		if (!_huge_pool) return false;
+
+		PageDescriptor *block = _huge_pool;
+		_huge_pool = block->next_free;
+		_huge_pool_count--;
+
+		block->next_free = NULL;
+		coalesce_block(block, HUGE_PAGE_ORDER);
+		return true;
+	}
+
+	/**
+	 * Returns TRUE if any free block below the given order lies within the given page-frame range.
+	 * @param start_pfn The first page-frame number in the range.
+	 * @param count The number of pages in the range.
+	 * @param below_order Only free lists below this order are searched.
+	 */
+	bool has_free_pages_within(pfn_t start_pfn, uint64_t count, int below_order) const
+	{
+		for (int order = 0; order < below_order; order++) 
+		{
+			for (const PageDescriptor *block = _free_areas[order].free_list; block; block = block->next_free) 
+			{
+				pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+				if (pfn >= start_pfn && pfn < start_pfn + count) return true;
+
+				// a sorted free list has nothing further on that can be in the range
+				if (FreeList::sorted && pfn >= start_pfn) break;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Chooses which block in the free list of the given order should be split or handed out, according
+	 * to a placement policy.
+	 * @param order The order to choose a block from.  The free list must not be empty.
+	 * @param policy The placement policy to follow.
+	 * @return Returns the chosen block, which is left on the free list.
+	 */
+	PageDescriptor *choose_block(int order, PlacementPolicy::PlacementPolicy policy) const
+	{
+		PageDescriptor *block = _free_areas[order].free_list;
+
+		switch (policy) 
+		{
+		case PlacementPolicy::HIGHEST_ADDRESS:
+			// a sorted free list ends with the highest address, and an unsorted one has to be searched
+			for (PageDescriptor *candidate = block->next_free; candidate; candidate = candidate->next_free) 
+			{
+				if (!FreeList::sorted && candidate < block) continue;
+
+				block = candidate;
+			}
+			return block;
+
+		case PlacementPolicy::BUDDY_ALLOCATED:
+			// a free block's buddy can never be wholly free (they would have merged), so look for one
+			// whose buddy has no free pages left in it at all
+			for (PageDescriptor *candidate = block; candidate; candidate = candidate->next_free) 
+			{
+				if (order == MAX_ORDER) return candidate;
+
+				pfn_t candidate_pfn = sys.mm().pgalloc().pgd_to_pfn(candidate);
+				pfn_t buddy_pfn = candidate_pfn ^ pages_per_block(order);
+				if (!has_free_pages_within(buddy_pfn, pages_per_block(order), order)) return candidate;
+			}
+
+			// no block has a fully allocated buddy, so fall back to the head of the list
+			return block;
+
+		case PlacementPolicy::LOWEST_ADDRESS:
+			return lowest_block(order);
+
+		default:
+			return block;
+		}
+	}
+
+	/**
+	 * Returns the lowest-addressed block in the free list of the given order.  For a sorted free list this
+	 * is just the head.
+	 * @param order The order to look in.  The free list must not be empty.
+	 */
+	PageDescriptor *lowest_block(int order) const
+	{
+		PageDescriptor *block = _free_areas[order].free_list;
+		if (FreeList::sorted) return block;
+
+		for (PageDescriptor *candidate = block->next_free; candidate; candidate = candidate->next_free) 
+		{
+			if (candidate < block) block = candidate;
+		}
+
+		return block;
+	}
+
+	/**
+	 * Packs a block into the form in which it is recorded in saved allocator state.
+	 * @param pgd The page descriptor of the block.
+	 * @param order The order of the block.
+	 * @param kind Where the block lives.
+	 */
+	static uint64_t pack_extent(const PageDescriptor *pgd, int order, SavedExtentKind::SavedExtentKind kind)
+	{
+		return (sys.mm().pgalloc().pgd_to_pfn(pgd) << 8) | ((uint64_t)kind << 6) | (uint64_t)order;
+	}
+
+	/**
+	 * Computes a checksum (FNV-1a) over packed extents, so that damaged saved state is not restored.
+	 * @param extents The packed extents.
+	 * @param nr_extents The number of packed extents.
+	 */
+	static uint64_t checksum_extents(const uint64_t *extents, uint64_t nr_extents)
+	{
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (uint64_t i = 0; i < nr_extents; i++) 
+		{
+			hash ^= extents[i];
+			hash *= 0x100000001b3ULL;
+		}
+
+		return hash;
+	}
+
+	/**
+	 * Finds a run of free max-order blocks that together form a correctly aligned block of an order above
+	 * MAX_ORDER, and removes the whole run from the free list.
+	 * @param order The order of the block to allocate.  Must be greater than MAX_ORDER.
+	 * @return Returns the first page descriptor of the run, or NULL if no suitable run is free.
+	 */
+	PageDescriptor *allocate_contiguous(int order)
+	{
+		uint64_t needed = pages_per_block(order - MAX_ORDER);
+		PageDescriptor *run = NULL;
+
+		// a run can only start on a block aligned for the requested order, and the rest of it is found
+		// through the per-page state, so this works whether or not the free list is sorted
+		for (PageDescriptor *block = _free_areas[MAX_ORDER].free_list; block && !run; block = block->next_free) 
+		{
+			if (!is_correct_alignment_for_order(block, order)) continue;
+
+			uint64_t run_length = 1;
+			while (run_length < needed && is_free_block(block + run_length * pages_per_block(MAX_ORDER), MAX_ORDER)) 
+			{
+				run_length++;
+			}
+
+			if (run_length == needed) run = block;
+		}
+
+		if (!run) return NULL;
+
+		// take every block in the run off the free list
+		for (uint64_t i = 0; i < needed; i++) 
+		{
+			remove_block(run + i * pages_per_block(MAX_ORDER), MAX_ORDER);
+		}
+
+		return run;
+	}
+
+	/**
+	 * Tops the gigantic-page pool back up to its target size.  Gigantic pages are only ever made from
+	 * whole max-order blocks, so this never splits anything.
+	 */
+	void refill_gigantic_pool()
+	{
+		while (_gigantic_pool_count < _gigantic_pool_target) 
+		{
+			PageDescriptor *block = allocate_with_flags(GIGANTIC_PAGE_ORDER, AllocFlags::NONE);
+			if (!block) return;
+
+			block->next_free = _gigantic_pool;
+			_gigantic_pool = block;
+			_gigantic_pool_count++;
+		}
+	}
+
+	/**
+	 * Tops up both reserve pools.  Gigantic pages go first, since they need the largest blocks.
+	 */
+	void refill_pools()
+	{
+		refill_gigantic_pool();
+		refill_huge_pool();
+	}
+
+	/**
+	 * Completes as many waiting asynchronous allocations as the free lists allow.  Each order's queue is
+	 * served first-in, first-out: a request that cannot be satisfied holds up the ones behind it, but not
+	 * the queues of other orders.
+	 */
+	void complete_waiting_allocations()
+	{
+		uint32_t waiting = _waiting_orders;
+		while (waiting) 
+		{
+			int order = __builtin_ctz(waiting);
+			waiting &= waiting - 1;
+
+			while (AllocationRequest *request = _waiting_requests[order]) 
+			{
+				// never drain the deferred-free queue from here, since that frees memory and comes back here
+				PageDescriptor *block = allocate_with_flags(order, request->flags | AllocFlags::NO_WAIT);
+				if (!block) break;
+
+				_waiting_requests[order] = request->next;
+				request->next = NULL;
+				_async_completed++;
+				_stats.allocated(order, true);
+
+				request->callback(request, block);
+			}
+
+			if (!_waiting_requests[order]) _waiting_orders &= ~(1U << order);
+		}
+	}
+
+	/**
+	 * Called whenever pages have gone back to the free lists: completes any waiting asynchronous
+	 * allocations first, and then tops up the reserve pools.
+	 */
+	void memory_freed()
+	{
+		// blocks on the deferred-free queue may be what a waiting allocation needs (and draining them
+		// comes back here once they are on the free lists)
+		if (_waiting_orders && __atomic_load_n(&_deferred_depth, __ATOMIC_RELAXED) && drain_deferred_frees()) return;
+
+		if (_waiting_orders) complete_waiting_allocations();
+		refill_pools();
+	}
+
+	/**
+	 * Hands every block in a reserve pool that overlaps the given page-frame range back to the free lists.
+	 * @param pool The pool to release blocks from.
+	 * @param pool_count The number of blocks held in the pool.
+	 * @param order The order of the blocks held in the pool.
+	 * @param start_pfn The first page-frame number in the range.
+	 * @param end_pfn The last page-frame number in the range (inclusive).
+	 */
+	void release_pool_range(PageDescriptor **pool, uint64_t& pool_count, int order, pfn_t start_pfn, pfn_t end_pfn)
+	{
+		PageDescriptor **slot = pool;
+		while (*slot) 
+		{
+			PageDescriptor *block = *slot;
+			pfn_t block_start = sys.mm().pgalloc().pgd_to_pfn(block);
+			pfn_t block_end = block_start + pages_per_block(order) - 1;
+
+			// skip over blocks that do not overlap the range
+			if (block_end < start_pfn || block_start > end_pfn) 
+			{
+				slot = &block->next_free;
+				continue;
+			}
+
+			// unlink the block from the pool, and give it back to the free lists
+			*slot = block->next_free;
+			pool_count--;
+
+			block->next_free = NULL;
+			free_block(block, order);
+		}
+	}
+
+	/**
+	 * Gives a block of any order back to the free lists, without refilling the reserve pools.  Blocks
+	 * above MAX_ORDER are handed back as their constituent max-order blocks.
+	 * @param pgd The page descriptor of the block to free.
+	 * @param order The order of the block.
+	 */
+	void free_block(PageDescriptor *pgd, int order)
+	{
+		if (order <= MAX_ORDER) 
+		{
+			coalesce_block(pgd, order);
+			return;
+		}
+
+		for (uint64_t i = 0; i < pages_per_block(order - MAX_ORDER); i++) 
+		{
+			coalesce_block(pgd + i * pages_per_block(MAX_ORDER), MAX_ORDER);
+		}
+	}
+
+	/**
+	 * Allocates the largest block available between two orders, in a single search of the free lists.
+	 * This is for callers that would like a large block if one is cheaply available, but can make do
+	 * with something smaller.  Like allocate_pages(), this leaves the pages held back for high-priority
+	 * allocations alone.  The caller must hold the allocator lock.
+	 * @param max_order The order to allocate, if possible.
+	 * @param min_order The smallest order that is acceptable.
+	 * @param got_order Receives the order of the block that was allocated.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * not even a block of min_order could be allocated.
+	 */
+	PageDescriptor *allocate_upto(int max_order, int min_order, int *got_order)
+	{
+		assert(min_order >= 0 && min_order <= max_order && max_order <= MAX_ORDER);
+
+		// drain deferred frees in batches, so that the queue never grows without bound
+		if (deferred_frees_due()) drain_deferred_frees();
+
+		// a full-size block can be split out of any order at or above the maximum
+		for (int free = max_order; free <= MAX_ORDER && within_reserve(max_order, AllocFlags::NONE); free++) 
+		{
+			if (_free_areas[free].free_list == NULL) continue;
+
+			*got_order = max_order;
+			return mark_allocated(split_down(choose_block(free, _placement.current()), free, max_order), max_order);
+		}
+
+		// otherwise, hand out a whole block from the largest non-empty order that is still acceptable
+		for (int free = max_order - 1; free >= min_order; free--) 
+		{
+			if (_free_areas[free].free_list == NULL || !within_reserve(free, AllocFlags::NONE)) continue;
+
+			*got_order = free;
+			return mark_allocated(split_down(choose_block(free, _placement.current()), free, free), free);
+		}
+
+		// nothing acceptable is free, so let the normal path try the deferred frees and reserve pools
+		*got_order = min_order;
+		return allocate_with_flags(min_order, AllocFlags::NONE);
+	}
+
+	/**
+	 * Drains the deferred-free queue, coalescing every queued block into the free lists.  The caller must
+	 * hold the allocator lock.
+	 * @return Returns the number of blocks that were drained.
+	 */
+	uint64_t drain_deferred_frees()
+	{
+		uint64_t drained = 0;
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			// take the whole stack at once, so that producers can carry on pushing to an empty one
+			PageDescriptor *block = __atomic_exchange_n(&_deferred_frees[order], NULL, __ATOMIC_ACQUIRE);
+			while (block) 
+			{
+				PageDescriptor *next = block->next_free;
+				block->next_free = NULL;
+				coalesce_block(block, order);
+				block = next;
+				drained++;
+			}
+		}
+
+		if (drained == 0) return 0;
+
+		__atomic_sub_fetch(&_deferred_depth, drained, __ATOMIC_RELAXED);
+		_deferred_batches++;
+
+		// larger blocks may have formed, so complete waiting allocations and let the reserve pools recover
+		memory_freed();
+		return drained;
+	}
+
+	/**
+	 * Removes a range of pages from the free lists, putting back whatever is left of the blocks that
+	 * contained it.  The reserve pools are left alone.
+	 * @param start A pointer to the first page descriptors to be made unavailable.
+	 * @param count The number of page descriptors to make unavailable.
+	 */
+	void remove_range(PageDescriptor *start, uint64_t count)
+	{
+		// convert page descriptor for start of remove range to a numeric format
+		pfn_t start_as_pfn = sys.mm().pgalloc().pgd_to_pfn(start);
+		pfn_t end_as_pfn = start_as_pfn + count;
+
+		while (start_as_pfn < end_as_pfn) 
+		{
+			// find the free block that contains the start of what is left of the range
+			pfn_t block_start;
+			int order = find_free_block(start_as_pfn, &block_start);
+
+			// if the page is not free, there is nothing to remove, so move on to the next one
+			if (order < 0) 
+			{
+				start_as_pfn++;
+				continue;
+			}
+
+			pfn_t block_end = block_start + pages_per_block(order);
+
+			// remove the whole block, and re-add the parts of it either side of the remove range
+			remove_block(sys.mm().pgalloc().pfn_to_pgd(block_start), order);
+			free_range(sys.mm().pgalloc().pfn_to_pgd(block_start), start_as_pfn - block_start);
+			if (end_as_pfn < block_end) 
+			{
+				free_range(sys.mm().pgalloc().pfn_to_pgd(end_as_pfn), block_end - end_as_pfn);
+			}
+
+			start_as_pfn = block_end;
+		}
+	}
+
+	/**
+	 * Frees 2^order contiguous pages into the free lists, and lets the reserve pools recover.  The caller
+	 * must hold the allocator lock.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void release_block(PageDescriptor *pgd, int order)
+	{
+		// Make sure that the incoming page descriptor is correctly aligned
+		// for the order on which it is being freed, for example, it is
+		// illegal to free page 1 in order-1.
+		assert(is_correct_alignment_for_order(pgd, order));
+
+		// free requested block, and then continuously merge blocks until it is no longer possible
+		free_block(pgd, order);
+
+		// larger blocks may have formed, so complete waiting allocations and let the reserve pools recover
+		memory_freed();
+	}
+
+	/**
+	 * Frees every block in a scatter-gather list.  The caller must hold the allocator lock.
+	 * @param extents The scatter-gather list.
+	 * @param nr_extents The number of entries in the scatter-gather list.
+	 */
+	void release_extents(const PageExtent *extents, uint64_t nr_extents)
+	{
+		for (uint64_t i = 0; i < nr_extents; i++) 
+		{
+			release_block(extents[i].pgd, extents[i].order);
+		}
+	}
+
+	/**
+	 * Returns the number of pages the per-page state tables take up: one byte of state, and one byte of
+	 * owner, for every page in the memory map.
+	 */
+	uint64_t page_table_pages() const
+	{
+		return (2 * _nr_page_descriptors + BYTES_PER_PAGE - 1) / BYTES_PER_PAGE;
+	}
+
+	/**
+	 * Places the per-page state tables in a run of pages, and marks every page as neither allocated nor
+	 * free.  The pages themselves are never put on the free lists.
+	 * @param pgd The page descriptor of the first page to hold the tables.
+	 */
+	void place_page_tables(PageDescriptor *pgd)
+	{
+		_page_tables = pgd;
+		_page_state = (uint8_t *)sys.mm().pgalloc().pgd_to_vpa(pgd);
+		_page_owner = _page_state + _nr_page_descriptors;
+
+		__builtin_memset(_page_state, 0, _nr_page_descriptors);
+		__builtin_memset(_page_owner, NO_OWNER_CPU, _nr_page_descriptors);
+	}
+
+	/**
+	 * Sets a range of pages aside until the memory map is settled, as the largest correctly aligned
+	 * blocks possible.  The blocks are linked through their page descriptors, so the pages themselves
+	 * are not touched.
+	 * @param start A pointer to the first page descriptor in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void add_pending_range(PageDescriptor *start, uint64_t count)
+	{
+		while (count > 0) 
+		{
+			int order = largest_block_order(start, count);
+
+			start->next_free = _pending_blocks[order];
+			_pending_blocks[order] = start;
+
+			start += pages_per_block(order);
+			count -= pages_per_block(order);
+		}
+	}
+
+	/**
+	 * Takes a range of pages out of the blocks waiting for the memory map to be settled.
+	 * @param start A pointer to the first page descriptor in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void remove_pending_range(PageDescriptor *start, uint64_t count)
+	{
+		PageDescriptor *end = start + count;
+
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			PageDescriptor **slot = &_pending_blocks[order];
+			while (*slot) 
+			{
+				PageDescriptor *block = *slot;
+				PageDescriptor *block_end = block + pages_per_block(order);
+
+				if (block_end <= start || block >= end) 
+				{
+					slot = &block->next_free;
+					continue;
+				}
+
+				// keep whatever lies on either side of the removed range.  the pieces are smaller than the
+				// block, so they land on lists that have already been searched.
+				*slot = block->next_free;
+				if (block < start) add_pending_range(block, start - block);
+				if (block_end > end) add_pending_range(end, block_end - end);
+			}
+		}
+	}
+
+	/**
+	 * Returns the order of the pending block that starts at a page, or -1 if no pending block does.
+	 * @param pgd The page descriptor to look for.
+	 */
+	int pending_block_order(const PageDescriptor *pgd) const
+	{
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			for (const PageDescriptor *block = _pending_blocks[order]; block; block = block->next_free) 
+			{
+				if (block == pgd) return order;
+			}
+		}
+
+		return -1;
+	}
+
+	/**
+	 * Returns the number of pages in the run of contiguous pending blocks that starts at a block, counting
+	 * no further than a limit.
+	 * @param start The page descriptor of the first block in the run.
+	 * @param limit The number of pages after which to stop counting.
+	 */
+	uint64_t pending_run_pages(const PageDescriptor *start, uint64_t limit) const
+	{
+		uint64_t pages = 0;
+		int order;
+
+		while (pages < limit && (order = pending_block_order(start + pages)) >= 0) 
+		{
+			pages += pages_per_block(order);
+		}
+
+		return pages;
+	}
+
+	/**
+	 * Breaks up the address order that blocks were inserted into the free lists in, if the free-list
+	 * policy shuffles.
+	 */
+	void shuffle_free_lists()
+	{
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			FreeList::shuffle(&_free_areas[order].free_list, _free_areas[order].nr_free, order);
+		}
+	}
+
+	/**
+	 * Places the per-page state tables once the memory map is settled, i.e. on the first operation other
+	 * than inserting or removing memory, and then frees every block that was set aside.  The caller must
+	 * hold the allocator lock.
+	 */
+	inline __attribute__((always_inline)) void settle_memory_map()
+	{
+		if (__builtin_expect(_page_state != NULL, 1)) return;
+
+		if (!place_pending_blocks()) 
+		{
+			mm_log.messagef(LogLevel::ERROR, "buddy: no inserted range can hold %lu pages of page tables", page_table_pages());
+		}
+	}
+
+	/**
+	 * Settles the memory map from a query, which would otherwise see none of the memory inserted so far.
+	 * Settling changes where the allocator keeps its state, not what a query reports, so queries stay
+	 * const.  If the lock is already held (by the caller, or by another CPU) the query sees the map as
+	 * it is.
+	 */
+	void settle_for_query() const
+	{
+		if (__builtin_expect(_page_state != NULL, 1)) return;
+
+		LockGuard guard(_lock, true);
+		if (guard.held()) const_cast<BasicBuddyPageAllocator *>(this)->place_pending_blocks();
+	}
+
+	/**
+	 * Carves the per-page state tables from the lowest run of pending blocks that can hold them, and
+	 * frees the rest.  Until now, nothing inserted has been written to, so memory that was inserted and
+	 * then reserved again (e.g. the kernel image) is never clobbered.
+	 * @return Returns FALSE if memory has been inserted, but no run of it can hold the tables yet.
+	 */
+	__attribute__((noinline)) bool place_pending_blocks()
+	{
+		uint64_t table_pages = page_table_pages();
+		PageDescriptor *tables = NULL;
+
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			for (PageDescriptor *block = _pending_blocks[order]; block; block = block->next_free) 
+			{
+				if (tables && block > tables) continue;
+				if (pending_run_pages(block, table_pages) >= table_pages) tables = block;
+			}
+		}
+
+		// leave everything pending, in case a later insert makes room for the tables
+		if (!tables) 
+		{
+			for (int order = 0; order <= MAX_ORDER; order++) 
+			{
+				if (_pending_blocks[order]) return false;
+			}
+
+			return true;
+		}
+
+		remove_pending_range(tables, table_pages);
+		place_page_tables(tables);
+
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			while (_pending_blocks[order]) 
+			{
+				PageDescriptor *block = _pending_blocks[order];
+				_pending_blocks[order] = block->next_free;
+				coalesce_block(block, order);
+			}
+		}
+
+		shuffle_free_lists();
+		memory_freed();
+		return true;
+	}
+
+	/**
+	 * Moves a batch of pages from the buddy lists into a CPU's page cache.  The pages are taken as one
+	 * block if possible, so that the batch costs a single search of the free lists.  The caller must hold the allocator lock.
+	 * @param pcp The CPU's page cache.
+	 * @return Returns TRUE if at least one page was added to the cache.
+	 */
+	bool refill_cpu_pages(PerCpuPages& pcp)
+	{
+		uint64_t added = 0;
+		while (added < pcp.batch) 
+		{
+			int got_order;
+			PageDescriptor *block = allocate_upto(63 - __builtin_clzll(pcp.batch - added), 0, &got_order);
+			if (!block) break;
+
+			// every page of the block becomes an order-0 allocation, cached lowest address first
+			pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+			__builtin_memset(&_page_state[pfn], PAGE_STATE_HEAD, pages_per_block(got_order));
+			for (uint64_t i = pages_per_block(got_order); i > 0; i--) 
+			{
+				PageDescriptor *pgd = block + (i - 1);
+				pgd->next_free = pcp.free_list;
+				pcp.free_list = pgd;
+			}
+
+			pcp.count += pages_per_block(got_order);
+			added += pages_per_block(got_order);
+		}
+
+		if (added) 
+		{
+			pcp.refills++;
+			pcp.epoch_batches++;
+		}
+		return added != 0;
+	}
+
+	/**
+	 * Gives pages from the cold end of a CPU's page cache back to the buddy lists.  The caller must hold
+	 * the allocator lock.
+	 * @param pcp The CPU's page cache.
+	 * @param nr_pages The number of pages to give back.
+	 */
+	void trim_cpu_pages(PerCpuPages& pcp, uint64_t nr_pages)
+	{
+		if (nr_pages == 0) return;
+
+		// the most recently freed pages are at the head, so keep those and cut off the rest
+		PageDescriptor **slot = &pcp.free_list;
+		for (uint64_t i = nr_pages; i < pcp.count; i++) 
+		{
+			slot = &(*slot)->next_free;
+		}
+
+		PageDescriptor *pgd = *slot;
+		*slot = NULL;
+		pcp.count -= nr_pages;
+		pcp.trims++;
+		pcp.epoch_batches++;
+
+		while (pgd) 
+		{
+			PageDescriptor *next = pgd->next_free;
+			pgd->next_free = NULL;
+			coalesce_block(pgd, 0);
+			pgd = next;
+		}
+
+		// larger blocks may have formed, so complete waiting allocations and let the reserve pools recover
+		memory_freed();
+	}
+
+	/**
+	 * Changes the high watermark of a CPU's page cache, keeping the batch at a quarter of it, and gives
+	 * back any pages above the new watermark.  The caller must hold the allocator lock.
+	 * @param pcp The CPU's page cache.
+	 * @param high The new high watermark.
+	 */
+	void set_cpu_pages_high(PerCpuPages& pcp, uint64_t high)
+	{
+		if (high < PCP_MIN_HIGH) high = PCP_MIN_HIGH;
+		if (high > PCP_MAX_HIGH) high = PCP_MAX_HIGH;
+
+		pcp.high = high;
+		pcp.batch = high / 4;
+
+		if (pcp.count > pcp.high) trim_cpu_pages(pcp, pcp.count - pcp.high);
+	}
+
+	/**
+	 * Adapts the size of a CPU's page cache to its allocation and free rate over the last tuning epoch, if
+	 * the epoch is over.  A cache that keeps going back to the buddy lists for batches is too small, so
+	 * it grows; a cache holding more than an epoch's worth of traffic is too large, so it shrinks; and a
+	 * cache that saw no traffic at all gives every page back.  The caller must hold the allocator lock.
+	 * @param pcp The CPU's page cache.
+	 */
+	void maybe_tune_cpu_pages(PerCpuPages& pcp)
+	{
+		uint64_t now = __builtin_ia32_rdtsc();
+		uint64_t elapsed = now - pcp.epoch_start;
+		if (elapsed < PCP_TUNE_CYCLES) return;
+
+		// if nothing tuned the cache for several epochs, spread what happened over all of them
+		uint64_t events = pcp.epoch_events / (elapsed / PCP_TUNE_CYCLES);
+		uint64_t batches = pcp.epoch_batches / (elapsed / PCP_TUNE_CYCLES);
+
+		if (events == 0) 
+		{
+			// an idle CPU should not hoard memory, including pages other CPUs have sent back to it
+			take_remote_frees(pcp);
+			if (pcp.count) pcp.idle_drains++;
+			trim_cpu_pages(pcp, pcp.count);
+			set_cpu_pages_high(pcp, PCP_MIN_HIGH);
+		}
+		else if (batches >= PCP_BUSY_BATCHES && pcp.high < PCP_MAX_HIGH) 
+		{
+			pcp.grows++;
+			set_cpu_pages_high(pcp, pcp.high * 2);
+		}
+		else if (events < pcp.high && pcp.high > PCP_MIN_HIGH) 
+		{
+			pcp.shrinks++;
+			set_cpu_pages_high(pcp, pcp.high / 2);
+		}
+
+		pcp.epoch_start = now;
+		pcp.epoch_events = 0;
+		pcp.epoch_batches = 0;
+	}
+
+	/**
+	 * Moves every page waiting in a CPU's remote-free inbox into its page cache.  Only the CPU itself may
+	 * do this, since it is the inbox's only consumer.
+	 * @param pcp The CPU's page cache.
+	 * @return Returns the number of pages moved.
+	 */
+	uint64_t take_remote_frees(PerCpuPages& pcp)
+	{
+		// take the whole inbox at once, so that producers can carry on pushing to an empty one
+		PageDescriptor *pgd = __atomic_exchange_n(&pcp.inbox, NULL, __ATOMIC_ACQUIRE);
+		if (!pgd) return 0;
+
+		uint64_t nr_pages = 0;
+		while (pgd) 
+		{
+			PageDescriptor *next = pgd->next_free;
+
+			pgd->next_free = pcp.free_list;
+			pcp.free_list = pgd;
+			pgd = next;
+			nr_pages++;
+		}
+
+		__atomic_sub_fetch(&pcp.inbox_depth, nr_pages, __ATOMIC_RELAXED);
+		pcp.count += nr_pages;
+		pcp.inbox_drains++;
+		pcp.inbox_pages += nr_pages;
+		return nr_pages;
+	}
+
+public:
+	/**
+	 * Allocates 2^order number of contiguous pages
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages(int order) override
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		PageDescriptor *block = allocate_with_flags(order, AllocFlags::NONE);
+		_stats.allocated(order, block != NULL);
+		return block;
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages, following a set of allocation flags.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param flags The allocation flags (see AllocFlags).
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed (or, with NO_WAIT, if the allocator lock was held).
+	 */
+	PageDescriptor *allocate_pages(int order, unsigned int flags)
+	{
+		// with NO_WAIT, the lock holder may be the very code this call has interrupted, so spinning
+		// could deadlock.  the failure is not counted, since the statistics are only safe under the lock.
+		LockGuard guard(_lock, flags & AllocFlags::NO_WAIT);
+		if (!guard.held()) return NULL;
+		settle_memory_map();
+
+		// take the fast path if there is nothing special to do
+		PageDescriptor *block;
+		if (flags == AllocFlags::NONE) block = allocate_with_flags(order, AllocFlags::NONE);
+		else block = allocate_with_flags(order, flags);
+
+		_stats.allocated(order, block != NULL);
+		return block;
+	}
+
+	/**
+	 * Allocates the largest block available between two orders, in a single search of the free lists.
+	 * This is for callers that would like a large block if one is cheaply available, but can make do
+	 * with something smaller.
+	 * @param max_order The order to allocate, if possible.
+	 * @param min_order The smallest order that is acceptable.
+	 * @param got_order Receives the order of the block that was allocated.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * not even a block of min_order could be allocated.
+	 */
+	PageDescriptor *allocate_pages_upto(int max_order, int min_order, int *got_order)
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		PageDescriptor *block = allocate_upto(max_order, min_order, got_order);
+		_stats.allocated(*got_order, block != NULL);
+		return block;
+	}
+
+	/**
+	 * Allocates 2^order contiguous pages without failing under memory pressure: if the pages cannot be
+	 * allocated straight away, the request is queued behind any others waiting for the same order, and its
+	 * callback is run once freed memory can satisfy it.  Callbacks run with the allocator lock held, from
+	 * whichever operation freed the memory, so they must not call back into the allocator; they should
+	 * just hand the block on (e.g. by waking up whatever is waiting for it).
+	 * @param request The request, with its order, flags and callback filled in.  Orders above MAX_ORDER
+	 * are not supported.
+	 * @return Returns a pointer to the first page descriptor of the newly allocated block, if it could be
+	 * allocated straight away (in which case the callback is never run), or NULL if the request was queued.
+	 */
+	PageDescriptor *allocate_pages_async(AllocationRequest *request)
+	{
+		assert(request->order >= 0 && request->order <= MAX_ORDER);
+		assert(request->callback);
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		// only allocate straight away if nothing queued earlier is waiting for the same order
+		if (!(_waiting_orders & (1U << request->order))) 
+		{
+			PageDescriptor *block = allocate_with_flags(request->order, request->flags);
+			if (block) 
+			{
+				_stats.allocated(request->order, true);
+				return block;
+			}
+		}
+
+		// add the request to the tail of its order's queue
+		AllocationRequest **slot = &_waiting_requests[request->order];
+		while (*slot) slot = &(*slot)->next;
+
+		request->next = NULL;
+		*slot = request;
+		_waiting_orders |= (1U << request->order);
+		_async_queued++;
+
+		return NULL;
+	}
+
+	/**
+	 * Withdraws a queued asynchronous allocation, so that its callback is never run.
+	 * @param request The request to withdraw.
+	 * @return Returns TRUE if the request was withdrawn, or FALSE if it was not queued (e.g. because its
+	 * callback has already run).
+	 */
+	bool cancel_allocation(AllocationRequest *request)
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		for (AllocationRequest **slot = &_waiting_requests[request->order]; *slot; slot = &(*slot)->next) 
+		{
+			if (*slot != request) continue;
+
+			*slot = request->next;
+			request->next = NULL;
+			if (!_waiting_requests[request->order]) _waiting_orders &= ~(1U << request->order);
+
+			_async_cancelled++;
+			return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Allocates a number of pages that need not be contiguous, using as few blocks as possible.  Each
+	 * step takes the largest block that does not overshoot the pages still needed, so large free blocks
+	 * are used whole and only the last few steps ever split anything.
+	 * @param count The number of pages to allocate.
+	 * @param extents The scatter-gather list to fill in.
+	 * @param max_extents The number of entries available in the scatter-gather list.
+	 * @return Returns the number of entries used, or zero if the pages could not be allocated within
+	 * max_extents entries (in which case nothing is left allocated).
+	 */
+	uint64_t allocate_pages_sg(uint64_t count, PageExtent *extents, uint64_t max_extents)
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		uint64_t nr_extents = 0;
+		uint64_t remaining = count;
+
+		while (remaining > 0) 
+		{
+			// the largest order that fits in what is still needed
+			int target = 63 - __builtin_clzll(remaining);
+			if (target > MAX_ORDER) target = MAX_ORDER;
+
+			int got_order;
+			PageDescriptor *block = nr_extents < max_extents ? allocate_upto(target, 0, &got_order) : NULL;
+			if (!block) 
+			{
+				// give back everything allocated so far
+				release_extents(extents, nr_extents);
+				_stats.allocated(0, false);
+				return 0;
+			}
+
+			_stats.allocated(got_order, true);
+			extents[nr_extents].pgd = block;
+			extents[nr_extents].order = got_order;
+			nr_extents++;
+
+			remaining -= pages_per_block(got_order);
+		}
+
+		return nr_extents;
+	}
+
+	/**
+	 * Frees every block in a scatter-gather list, e.g. one filled in by allocate_pages_sg().
+	 * @param extents The scatter-gather list.
+	 * @param nr_extents The number of entries in the scatter-gather list.
+	 */
+	void free_pages_sg(const PageExtent *extents, uint64_t nr_extents)
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		for (uint64_t i = 0; i < nr_extents; i++) 
+		{
+			release_block(extents[i].pgd, extents[i].order);
+			_stats.freed(extents[i].order);
+		}
+	}
+
+	/**
+	 * Grows an allocated block to the next order in place, by taking its buddy, if the buddy is free.  The
+	 * block keeps its address, so the caller does not need to copy anything.
+	 * @param pgd A pointer to the first page descriptor of the allocated block.
+	 * @param order The current order of the allocated block.
+	 * @return Returns TRUE if the block now has order + 1, or FALSE if it could not be grown (in which case
+	 * it is left as it was).
+	 */
+	bool try_expand(PageDescriptor *pgd, int order)
+	{
+		assert(is_correct_alignment_for_order(pgd, order));
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		// the block can only grow in place if it is the left-hand half of the pair
+		if (order >= MAX_ORDER || !is_correct_alignment_for_order(pgd, order + 1)) return false;
+
+		// growing takes as many pages as allocating the buddy would
+		if (!within_reserve(order, AllocFlags::NONE)) return false;
+
+		// a free buddy is always a whole block of the same order, since it would otherwise have
+		// coalesced with the rest of its free pages
+		if (!try_remove_block(buddy_of(pgd, order), order)) return false;
+
+		mark_allocated(pgd, order + 1);
+		return true;
+	}
+
+	/**
+	 * Shrinks an allocated block to the previous order in place, by freeing its upper half.
+	 * @param pgd A pointer to the first page descriptor of the allocated block.
+	 * @param order The current order of the allocated block.
+	 */
+	void shrink(PageDescriptor *pgd, int order)
+	{
+		assert(order > 0 && order <= MAX_ORDER);
+		assert(is_correct_alignment_for_order(pgd, order));
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		_page_state[sys.mm().pgalloc().pgd_to_pfn(pgd)] = PAGE_STATE_HEAD | (order - 1);
+		release_block(pgd + pages_per_block(order - 1), order - 1);
+	}
+
+	/**
+	 * Frees part of an allocated block.  The sub-range need not be aligned: it is broken up into the
+	 * largest correctly aligned blocks that fit, and each of those coalesces with any free neighbours.
+	 * The rest of the block stays allocated, and can be freed later in the same way (but not with the
+	 * order-less free_pages(): once part of a block has been freed, order_of() no longer reports an order
+	 * for it).
+	 * @param pgd A pointer to the first page descriptor of the allocated block.
+	 * @param order The order the block was allocated with.
+	 * @param offset The offset (in pages) into the block of the first page to free.
+	 * @param count The number of pages to free.
+	 */
+	void free_partial(PageDescriptor *pgd, int order, uint64_t offset, uint64_t count)
+	{
+		assert(is_correct_alignment_for_order(pgd, order));
+		assert(offset + count <= pages_per_block(order));
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		free_range(pgd + offset, count);
+
+		// if the head page is still allocated, it must stop claiming the whole block (if it was freed, its
+		// state now belongs to whatever free block it is part of)
+		uint8_t *head_state = &_page_state[sys.mm().pgalloc().pgd_to_pfn(pgd)];
+		if (count > 0 && (*head_state & PAGE_STATE_KIND_MASK) == PAGE_STATE_HEAD) *head_state = PAGE_STATE_PARTIAL;
+
+		// larger blocks may have formed, so complete waiting allocations and let the reserve pools recover
+		memory_freed();
+	}
+
+	/**
+	 * Frees the tail of an allocated block, keeping only its first few pages.
+	 * @param pgd A pointer to the first page descriptor of the allocated block.
+	 * @param order The order the block was allocated with.
+	 * @param keep The number of pages at the start of the block to keep allocated.
+	 */
+	void free_trailing(PageDescriptor *pgd, int order, uint64_t keep)
+	{
+		assert(keep <= pages_per_block(order));
+
+		free_partial(pgd, order, keep, pages_per_block(order) - keep);
+	}
+
+	/**
+	 * Returns TRUE if the page is free (i.e. part of a block on a free list), in O(MAX_ORDER) time.
+	 * @param pfn The page-frame number of the page.
+	 */
+	bool is_free(pfn_t pfn) const
+	{
+		settle_for_query();
+
+		LockGuard guard(_lock);
+
+		if (!_page_state) return false;
+
+		pfn_t block_pfn;
+		return find_free_block(pfn, &block_pfn) >= 0;
+	}
+
+	/**
+	 * Returns the total number of free pages on the free lists, in O(1).
+	 */
+	uint64_t free_pages_total() const
+	{
+		settle_for_query();
+
+		return _nr_free_pages;
+	}
+
+	/**
+	 * Returns the number of free blocks of the given order, in O(1).
+	 * @param order The order to count free blocks in.
+	 * @return Returns the number of free blocks, or zero if the order is out of range.
+	 */
+	uint64_t free_blocks(int order) const
+	{
+		settle_for_query();
+
+		if (order < 0 || order > MAX_ORDER) return 0;
+
+		return _free_areas[order].nr_free;
+	}
+
+	/**
+	 * Returns TRUE if allocate_pages() would currently succeed for the given order, in O(1).  Like
+	 * allocate_pages(), this counts a huge page that could be taken out of the pool, and leaves the pages
+	 * held back for high-priority allocations alone.  Blocks still on the deferred-free queue are not
+	 * counted, and orders above MAX_ORDER are never admitted.
+	 * @param order The order to check.
+	 */
+	bool can_allocate(int order) const
+	{
+		settle_for_query();
+
+		if (order < 0 || order > MAX_ORDER) return false;
+
+		if (_nonempty_orders >> order) return within_reserve(order, AllocFlags::NONE);
+
+		// with nothing large enough free, allocate_pages() splits a huge page out of the pool
+		return order <= HUGE_PAGE_ORDER && _huge_pool && _nr_free_pages + pages_per_block(HUGE_PAGE_ORDER) >= pages_per_block(order) + _reserve_pages;
+	}
+
+	/**
+	 * Returns the order of an allocated block, from the metadata recorded in its head page, in O(1).
+	 * @param pgd A pointer to the first page descriptor of the block.
+	 * @return Returns the order of the block, or -1 if the page is not the head of an allocated block (or
+	 * heads one that has been partly freed).
+	 */
+	int order_of(const PageDescriptor *pgd) const
+	{
+		if (!_page_state) return -1;
+
+		uint8_t state = _page_state[sys.mm().pgalloc().pgd_to_pfn(pgd)];
+		if ((state & PAGE_STATE_KIND_MASK) != PAGE_STATE_HEAD || state == PAGE_STATE_PARTIAL) return -1;
+
+		return state & PAGE_STATE_ORDER_MASK;
+	}
+
+	/**
+	 * Returns TRUE if the page is part of an allocated block, other than its first page.
+	 * @param pgd A pointer to the page descriptor to check.
+	 */
+	bool is_tail_page(const PageDescriptor *pgd) const
+	{
+		if (!_page_state) return false;
+
+		return (_page_state[sys.mm().pgalloc().pgd_to_pfn(pgd)] & PAGE_STATE_KIND_MASK) == PAGE_STATE_TAIL;
+	}
+
+	/**
+	 * Frees an allocated block without the caller having to remember its order, which is looked up from
+	 * the metadata recorded in its head page.
+	 * @param pgd A pointer to the first page descriptor of the block.
+	 */
+	void free_pages(PageDescriptor *pgd)
+	{
+		int order = order_of(pgd);
+		assert(order >= 0);
+
+		free_pages(pgd, order);
+	}
+
+    /**
+	 * Frees 2^order contiguous pages.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+    void free_pages(PageDescriptor *pgd, int order) override
+    {
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		release_block(pgd, order);
+		_stats.freed(order);
+    }
+
+	/**
+	 * Frees 2^order contiguous pages, following a set of allocation flags.  Only ZERO (scrub the pages
+	 * before they are freed) and DEFER (free through the deferred-free queue) affect freeing.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 * @param flags The allocation flags (see AllocFlags).
+	 */
+	void free_pages(PageDescriptor *pgd, int order, unsigned int flags)
+	{
+		if (flags & AllocFlags::ZERO) zero_block(pgd, order);
+
+		if (flags & AllocFlags::DEFER) free_pages_deferred(pgd, order);
+		else free_pages(pgd, order);
+	}
+
+	/**
+	 * Queues 2^order contiguous pages to be freed later, by the next batch drained from the deferred-free
+	 * queue.  This is lock-free and O(1), so it is safe to call from interrupt context and other hot paths
+	 * that cannot afford to coalesce.  If an asynchronous allocation is waiting, the queue is drained by
+	 * the next allocator operation or poll_deferred_frees(), whichever comes first.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void free_pages_deferred(PageDescriptor *pgd, int order)
+	{
+		assert(order <= MAX_ORDER);
+		assert(is_correct_alignment_for_order(pgd, order));
+
+		// push the block onto the order's stack, linking it through next_free
+		PageDescriptor *head = __atomic_load_n(&_deferred_frees[order], __ATOMIC_RELAXED);
+		do 
+		{
+			pgd->next_free = head;
+		} while (!__atomic_compare_exchange_n(&_deferred_frees[order], &head, pgd, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+		// keep track of how deep the queue has ever been
+		uint64_t depth = __atomic_add_fetch(&_deferred_depth, 1, __ATOMIC_RELAXED);
+		uint64_t high_water = __atomic_load_n(&_deferred_high_water, __ATOMIC_RELAXED);
+		while (depth > high_water && !__atomic_compare_exchange_n(&_deferred_high_water, &high_water, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	/**
+	 * Drains the deferred-free queue, coalescing every queued block into the free lists.
+	 * @return Returns the number of blocks that were drained.
+	 */
+	uint64_t flush_deferred_frees()
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+		return drain_deferred_frees();
+	}
+
+	/**
+	 * Drains the deferred-free queue if an asynchronous allocation is waiting, so that the waiting
+	 * allocation completes even if nothing else touches the allocator.  free_pages_deferred() cannot do
+	 * this itself, since it must never take the lock.  This should be called from the periodic timer
+	 * tick, and only takes the lock when there is something to do.
+	 * @return Returns the number of blocks that were drained.
+	 */
+	uint64_t poll_deferred_frees()
+	{
+		if (!__atomic_load_n(&_waiting_orders, __ATOMIC_RELAXED) || !__atomic_load_n(&_deferred_depth, __ATOMIC_RELAXED)) return 0;
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+		return _waiting_orders ? drain_deferred_frees() : 0;
+	}
+
+	/**
+	 * Returns the number of blocks currently waiting in the deferred-free queue.
+	 */
+	uint64_t deferred_free_depth() const
+	{
+		return __atomic_load_n(&_deferred_depth, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Returns the largest number of blocks that have ever been waiting in the deferred-free queue.
+	 */
+	uint64_t deferred_free_high_water() const
+	{
+		return __atomic_load_n(&_deferred_high_water, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Allocates a single page from a CPU's page cache, refilling the cache from the buddy lists in a batch
+	 * if it is empty.  This must only be called on the given CPU, with interrupts that could also use
+	 * the cache disabled.
+	 * @param cpu The CPU that is allocating.
+	 * @return Returns a pointer to the page descriptor of the newly allocated page, or NULL if allocation
+	 * failed.
+	 */
+	PageDescriptor *allocate_page(unsigned int cpu)
+	{
+		assert(cpu < NR_CPUS);
+		PerCpuPages& pcp = _cpu_pages[cpu];
+
+		pcp.epoch_events++;
+
+		// pages freed by other CPUs are the coldest, so only take them back when the cache needs them
+		if (!pcp.free_list && __atomic_load_n(&pcp.inbox, __ATOMIC_RELAXED)) take_remote_frees(pcp);
+		if (!pcp.free_list) 
+		{
+			LockGuard guard(_lock);
+			settle_memory_map();
+
+			maybe_tune_cpu_pages(pcp);
+			if (!refill_cpu_pages(pcp)) return NULL;
+		}
+
+		PageDescriptor *pgd = pcp.free_list;
+		pcp.free_list = pgd->next_free;
+		pcp.count--;
+		pcp.allocations++;
+
+		pgd->next_free = NULL;
+		_page_owner[sys.mm().pgalloc().pgd_to_pfn(pgd)] = cpu;
+		return pgd;
+	}
+
+	/**
+	 * Frees a single page allocated with allocate_page().  If the page was allocated on another CPU, it is
+	 * sent back to that CPU's remote-free inbox, rather than polluting this CPU's cache.  This must only
+	 * be called on the given CPU, with interrupts that could also use the cache disabled.
+	 * @param cpu The CPU that is freeing.
+	 * @param pgd A pointer to the page descriptor of the page.
+	 */
+	void free_page(unsigned int cpu, PageDescriptor *pgd)
+	{
+		assert(cpu < NR_CPUS);
+		PerCpuPages& pcp = _cpu_pages[cpu];
+
+		pcp.epoch_events++;
+
+		uint8_t owner = _page_owner[sys.mm().pgalloc().pgd_to_pfn(pgd)];
+		if (owner != NO_OWNER_CPU && owner != cpu) 
+		{
+			PerCpuPages& remote = _cpu_pages[owner];
+
+			// push the page onto the owner's inbox, linking it through next_free
+			PageDescriptor *head = __atomic_load_n(&remote.inbox, __ATOMIC_RELAXED);
+			do 
+			{
+				pgd->next_free = head;
+			} while (!__atomic_compare_exchange_n(&remote.inbox, &head, pgd, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+			__atomic_add_fetch(&remote.inbox_depth, 1, __ATOMIC_RELAXED);
+			pcp.remote_frees++;
+		}
+		else 
+		{
+			pgd->next_free = pcp.free_list;
+			pcp.free_list = pgd;
+			pcp.count++;
+			pcp.local_frees++;
+		}
+
+		// take back this CPU's own pages in batches, so that its inbox never grows without bound
+		if (__atomic_load_n(&pcp.inbox_depth, __ATOMIC_RELAXED) >= REMOTE_FREE_BATCH) take_remote_frees(pcp);
+		if (pcp.count > pcp.high) 
+		{
+			LockGuard guard(_lock);
+			settle_memory_map();
+
+			maybe_tune_cpu_pages(pcp);
+			if (pcp.count > pcp.high) trim_cpu_pages(pcp, pcp.count - pcp.batch);
+		}
+	}
+
+	/**
+	 * Adapts the size of a CPU's page cache to its recent allocation and free rate, if a tuning epoch has
+	 * passed.  This should be called from each CPU's periodic timer tick, since an idle CPU never reaches
+	 * the slow paths that tune the cache otherwise, and so would hold on to its cached pages for good.
+	 * This must only be called on the given CPU.
+	 * @param cpu The CPU whose cache to tune.
+	 */
+	void tune_cpu_pages(unsigned int cpu)
+	{
+		assert(cpu < NR_CPUS);
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+		maybe_tune_cpu_pages(_cpu_pages[cpu]);
+	}
+
+	/**
+	 * Takes back every page waiting in a CPU's remote-free inbox.  This must only be called on the given CPU.
+	 * @param cpu The CPU whose inbox to drain.
+	 * @return Returns the number of pages taken back.
+	 */
+	uint64_t drain_remote_frees(unsigned int cpu)
+	{
+		assert(cpu < NR_CPUS);
+		PerCpuPages& pcp = _cpu_pages[cpu];
+
+		uint64_t nr_pages = take_remote_frees(pcp);
+		if (pcp.count > pcp.high) 
+		{
+			LockGuard guard(_lock);
+			settle_memory_map();
+			trim_cpu_pages(pcp, pcp.count - pcp.batch);
+		}
+		return nr_pages;
+	}
+
+	/**
+	 * Gives every page in a CPU's page cache (and its remote-free inbox) back to the buddy lists, e.g.
+	 * when the CPU goes offline.  This must only be called on the given CPU, or once it has stopped.
+	 * @param cpu The CPU whose cache to drain.
+	 */
+	void drain_cpu_pages(unsigned int cpu)
+	{
+		assert(cpu < NR_CPUS);
+		PerCpuPages& pcp = _cpu_pages[cpu];
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		take_remote_frees(pcp);
+		trim_cpu_pages(pcp, pcp.count);
+	}
+
+	/**
+	 * Returns the number of pages held in a CPU's page cache.
+	 * @param cpu The CPU to look at.
+	 */
+	uint64_t cpu_cached_pages(unsigned int cpu) const
+	{
+		assert(cpu < NR_CPUS);
+		return _cpu_pages[cpu].count;
+	}
+
+	/**
+	 * Returns the current high watermark of a CPU's page cache.
+	 * @param cpu The CPU to look at.
+	 */
+	uint64_t cpu_pages_high(unsigned int cpu) const
+	{
+		assert(cpu < NR_CPUS);
+		return _cpu_pages[cpu].high;
+	}
+
+    /**
+     * Marks a range of pages as available for allocation.
+     * @param start A pointer to the first page descriptors to be made available.
+     * @param count The number of page descriptors to make available.
+     */
+    virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
+    {
+		LockGuard guard(_lock);
+
+		// the memory map is still being built, and parts of this range may yet be reserved, so it is set
+		// aside untouched until the map is settled
+		if (!_page_state) 
+		{
+			add_pending_range(start, count);
+			return;
+		}
+
+		free_range(start, count);
+		shuffle_free_lists();
+		memory_freed();
+    }
+
+    /**
+     * Marks a range of pages as unavailable for allocation.
+     * @param start A pointer to the first page descriptors to be made unavailable.
+     * @param count The number of page descriptors to make unavailable.
+     */
+    virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
+    {
+		if (count == 0) return;
+
+		LockGuard guard(_lock);
+
+		if (!_page_state) 
+		{
+			remove_pending_range(start, count);
+			return;
+		}
+
+		// the tables are in use like any allocated pages, so they stay put
+		if (start < _page_tables + page_table_pages() && start + count > _page_tables) 
+		{
+			pfn_t tables_pfn = sys.mm().pgalloc().pgd_to_pfn(_page_tables);
+			mm_log.messagef(LogLevel::WARNING, "buddy: cannot remove pages %lu-%lu, which hold the page tables", tables_pfn, tables_pfn + page_table_pages() - 1);
+		}
+
+		// pages held in the reserve pools are not on the free lists, so put back any that overlap the range first
+		pfn_t start_as_pfn = sys.mm().pgalloc().pgd_to_pfn(start);
+		release_pool_range(&_gigantic_pool, _gigantic_pool_count, GIGANTIC_PAGE_ORDER, start_as_pfn, start_as_pfn + count - 1);
+		release_pool_range(&_huge_pool, _huge_pool_count, HUGE_PAGE_ORDER, start_as_pfn, start_as_pfn + count - 1);
+
+		remove_range(start, count);
+
+		// pool blocks outside the range may have gone back to the free lists too
+		memory_freed();
+    }
+
+	/**
+	 * Changes the placement policy used to choose which free block allocate_pages() splits.
+	 * @param policy The placement policy to use from now on.
+	 */
+	void set_placement_policy(PlacementPolicy::PlacementPolicy policy)
+	{
+		_placement.set(policy);
+	}
+
+	/**
+	 * Changes the number of free pages held back for high-priority allocations.  Other allocations fail
+	 * rather than leave fewer than this many pages free.
+	 * @param nr_pages The number of pages to hold back.
+	 */
+	void set_reserve_pages(uint64_t nr_pages)
+	{
+		_reserve_pages = nr_pages;
+	}
+
+	/**
+	 * Returns the largest order that can currently be allocated without touching the reserve pools,
+	 * or -1 if there is no free memory at all.  This is the main measure of external fragmentation.
+	 */
+	int largest_free_order() const
+	{
+		settle_for_query();
+
+		if (!_nonempty_orders) return -1;
+
+		return 31 - __builtin_clz(_nonempty_orders);
+	}
+
+	/**
+	 * Changes the number of huge pages the huge-page pool keeps in reserve.  Growing the pool takes
+	 * order-9 blocks from the free lists straight away (as far as possible), and shrinking it gives the
+	 * surplus back.
+	 * @param nr_huge_pages The number of huge pages to keep in the pool.
+	 */
+	void set_huge_pool_size(uint64_t nr_huge_pages)
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		_huge_pool_target = nr_huge_pages;
+
+		// give back any surplus, then top up to the new size
+		while (_huge_pool_count > _huge_pool_target) 
+		{
+			release_huge_page();
+		}
+		memory_freed();
+	}
+
+	/**
+	 * Allocates a single huge page (an order-9 block), preferring the huge-page pool, and falling back
+	 * to splitting a larger block from the free lists if the pool is empty.
+	 * @return Returns a pointer to the first page descriptor of the huge page, or NULL if allocation failed.
+	 */
+	PageDescriptor *allocate_huge_page()
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		if (_huge_pool) 
+		{
+			PageDescriptor *block = _huge_pool;
+			_huge_pool = block->next_free;
+			_huge_pool_count--;
+
+			block->next_free = NULL;
+			return mark_allocated(block, HUGE_PAGE_ORDER);
+		}
+
+		return allocate_with_flags(HUGE_PAGE_ORDER, AllocFlags::NONE);
+	}
+
+	/**
+	 * Frees a huge page, returning it to the huge-page pool if the pool is below its target size, or to
+	 * the free lists otherwise.
+	 * @param pgd A pointer to the first page descriptor of the huge page.
+	 */
+	void free_huge_page(PageDescriptor *pgd)
+	{
+		assert(is_correct_alignment_for_order(pgd, HUGE_PAGE_ORDER));
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		if (_huge_pool_count < _huge_pool_target) 
+		{
+			pgd->next_free = _huge_pool;
+			_huge_pool = pgd;
+			_huge_pool_count++;
+			return;
+		}
+
+		release_block(pgd, HUGE_PAGE_ORDER);
+	}
+
+	/**
+	 * Returns TRUE if every page in the given 2 MiB-aligned region is free in the buddy lists, i.e. the
+	 * region is covered by a single free block of order-9 or above.  The VM layer uses this to decide
+	 * whether a mapping can be promoted to a huge page.
+	 * @param pgd A pointer to the first page descriptor of the region.
+	 */
+	bool is_huge_region_free(const PageDescriptor *pgd) const
+	{
+		settle_for_query();
+
+		assert(is_correct_alignment_for_order(pgd, HUGE_PAGE_ORDER));
+
+		LockGuard guard(_lock);
+
+		// the region is free iff the block containing it at some order >= 9 is on that order's free list
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		for (int order = HUGE_PAGE_ORDER; order <= MAX_ORDER; order++) 
+		{
+			pfn_t block_pfn = pfn & ~(pages_per_block(order) - 1);
+			if (is_free_block(sys.mm().pgalloc().pfn_to_pgd(block_pfn), order)) return true;
+		}
+
+		return false;
+	}
+
+	/**
+	 * Returns the number of huge pages that could currently be handed out, both from the pool and by
+	 * splitting free blocks of order-9 and above.
+	 */
+	uint64_t huge_pages_available() const
+	{
+		settle_for_query();
+
+		uint64_t available = _huge_pool_count;
+		for (int order = HUGE_PAGE_ORDER; order <= MAX_ORDER; order++) 
+		{
+			available += _free_areas[order].nr_free * pages_per_block(order - HUGE_PAGE_ORDER);
+		}
+
+		return available;
+	}
+
+	/**
+	 * Changes the number of gigantic pages held in reserve.  Growing the reservation takes whole blocks
+	 * from the free lists straight away (as far as possible), and shrinking it gives the surplus back.
+	 * @param nr_gigantic_pages The number of gigantic pages to reserve.
+	 */
+	void set_gigantic_pool_size(uint64_t nr_gigantic_pages)
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		_gigantic_pool_target = nr_gigantic_pages;
+
+		// give back any surplus, then top up to the new size
+		while (_gigantic_pool_count > _gigantic_pool_target) 
+		{
+			PageDescriptor *block = _gigantic_pool;
+			_gigantic_pool = block->next_free;
+			_gigantic_pool_count--;
+
+			block->next_free = NULL;
+			free_block(block, GIGANTIC_PAGE_ORDER);
+		}
+		memory_freed();
+	}
+
+	/**
+	 * Allocates a single gigantic page, taking it from the reserved pool if possible, and otherwise
+	 * trying to find a free block (or run of blocks) of the right size.
+	 * @return Returns a pointer to the first page descriptor of the gigantic page, or NULL if allocation failed.
+	 */
+	PageDescriptor *allocate_gigantic_page()
+	{
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		if (_gigantic_pool) 
+		{
+			PageDescriptor *block = _gigantic_pool;
+			_gigantic_pool = block->next_free;
+			_gigantic_pool_count--;
 
-/**
- * A buddy page allocation algorithm.
- */
-class BuddyPageAllocator : public PageAllocatorAlgorithm
-{
-private:
+			block->next_free = NULL;
+			return mark_allocated(block, GIGANTIC_PAGE_ORDER);
+		}
+
+		return allocate_with_flags(GIGANTIC_PAGE_ORDER, AllocFlags::NONE);
+	}
 
 	/**
-	 * Returns the number of pages that comprise a 'block', in a given order.
-	 * @param order The order to base the calculation off of.
-	 * @return Returns the number of pages in a block, in the order.
+	 * Frees a gigantic page, returning it to the reserved pool if the pool is below its target size, or
+	 * to the free lists otherwise.
+	 * @param pgd A pointer to the first page descriptor of the gigantic page.
 	 */
-	static inline constexpr uint64_t pages_per_block(int order)
+	void free_gigantic_page(PageDescriptor *pgd)
 	{
-		/* The number of pages per block in a given order is simply 1, shifted left by the order number.
-		 * For example, in order-2, there are (1 << 2) == 4 pages in each block.
-		 */
-		return (1 << order);
+		assert(is_correct_alignment_for_order(pgd, GIGANTIC_PAGE_ORDER));
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		if (_gigantic_pool_count < _gigantic_pool_target) 
+		{
+			pgd->next_free = _gigantic_pool;
+			_gigantic_pool = pgd;
+			_gigantic_pool_count++;
+			return;
+		}
+
+		release_block(pgd, GIGANTIC_PAGE_ORDER);
 	}
 
 	/**
-	 * Returns TRUE if the supplied page descriptor is correctly aligned for the 
-	 * given order.  Returns FALSE otherwise.
-	 * @param pgd The page descriptor to test alignment for.
-	 * @param order The order to use for calculations.
+	 * Sets the backend that free page reporting hands free blocks to.  Reporting only happens when
+	 * report_free_pages() is called, e.g. from a periodic timer.
+	 * @param backend The backend to report to, or NULL to stop reporting.
+	 * @param min_order The smallest order of free block to report.
 	 */
-	static inline bool is_correct_alignment_for_order(const PageDescriptor *pgd, int order)
+	void set_reporting_backend(FreePageReportingBackend *backend, int min_order)
 	{
-		// Calculate the page-frame-number for the page descriptor, and return TRUE if
-		// it divides evenly into the number pages in a block of the given order.
-		return (sys.mm().pgalloc().pgd_to_pfn(pgd) % pages_per_block(order)) == 0;
+		assert(min_order >= 0 && min_order <= MAX_ORDER);
+
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		_reporting_backend = backend;
+		_reporting_order = min_order;
 	}
 
-	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
-	 * to the left or the right of PGD, in the given order.
-	 * @param pgd The page descriptor to find the buddy for.
-	 * @param order The order in which the page descriptor lives.
-	 * @return Returns the buddy of the given page descriptor, in the given order.
+	/**
+	 * Reports every free block of the reporting order or above that has not been reported since it last
+	 * joined the free lists.  A block that is allocated, split or coalesced loses its reported mark, so
+	 * whatever free block it ends up in is reported again by a later pass.
+	 * @return Returns the number of pages reported.
 	 */
-	PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
+	uint64_t report_free_pages()
 	{
-        	// (1) Make sure 'order' is within range
-		if (order >= MAX_ORDER) 
-		{
-			return NULL;
-		}
+		LockGuard guard(_lock);
+		settle_memory_map();
 
-		// (2) Check to make sure that PGD is correctly aligned in the order
-		if (!is_correct_alignment_for_order(pgd, order)) 
+		if (!_reporting_backend) return 0;
+
+		uint64_t start = __builtin_ia32_rdtsc();
+		uint64_t nr_pages = 0;
+
+		// report the largest blocks first, since they are the least likely to be allocated again soon
+		for (int order = MAX_ORDER; order >= _reporting_order; order--) 
 		{
-			return NULL;
-		}
+			for (PageDescriptor *block = _free_areas[order].free_list; block; block = block->next_free) 
+			{
+				pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+				if (_page_state[pfn] & PAGE_STATE_REPORTED) continue;
 
-		// (3) Calculate the page-frame-number of the buddy of this page.
-		// * If the PFN is aligned to the next order, then the buddy is the next block in THIS order.
-		// * If it's not aligned, then the buddy must be the previous block in THIS order.
-		uint64_t buddy_pfn = is_correct_alignment_for_order(pgd, order + 1) ?
-			sys.mm().pgalloc().pgd_to_pfn(pgd) + pages_per_block(order) : 
-			sys.mm().pgalloc().pgd_to_pfn(pgd) - pages_per_block(order);
+				_reporting_backend->report(pfn, pages_per_block(order));
+				_page_state[pfn] |= PAGE_STATE_REPORTED;
+				_free_areas[order].nr_reported++;
 
-		// (4) Return the page descriptor associated with the buddy page-frame-number.
-		return sys.mm().pgalloc().pfn_to_pgd(buddy_pfn);
+				nr_pages += pages_per_block(order);
+				_report_blocks++;
+			}
+		}
+
+		_report_passes++;
+		_report_pages += nr_pages;
+		_report_cycles += __builtin_ia32_rdtsc() - start;
+		return nr_pages;
 	}
 
 	/**
-	 * Inserts a block into the free list of the given order.  The block is inserted in ascending order.
-	 * @param pgd The page descriptor of the block to insert.
-	 * @param order The order in which to insert the block.
-	 * @return Returns the slot (i.e. a pointer to the pointer that points to the block) that the block
-	 * was inserted into.
+	 * Returns the number of free pages that are currently reported to the host.
 	 */
-	PageDescriptor **insert_block(PageDescriptor *pgd, int order)
+	uint64_t reported_free_pages() const
 	{
-		// Starting from the _free_area array, find the slot in which the page descriptor
-		// should be inserted.
-		PageDescriptor **slot = &_free_areas[order];
+		settle_for_query();
 
-		// Iterate whilst there is a slot, and whilst the page descriptor pointer is numerically
-		// greater than what the slot is pointing to.
-		while (*slot && pgd > *slot) 
+		uint64_t nr_pages = 0;
+		for (int order = 0; order <= MAX_ORDER; order++) 
 		{
-			slot = &(*slot)->next_free;
+			nr_pages += _free_areas[order].nr_reported * pages_per_block(order);
 		}
 
-		// Insert the page descriptor into the linked list.
-		pgd->next_free = *slot;
-		*slot = pgd;
-
-		// Return the insert point (i.e. slot)
-		return slot;
+		return nr_pages;
 	}
 
 	/**
-	 * Removes a block from the free list of the given order.  The block MUST be present in the free-list, otherwise
-	 * the system will panic.
-	 * @param pgd The page descriptor of the block to remove.
-	 * @param order The order in which to remove the block from.
+	 * Returns the number of free pages, in blocks of the reporting order or above, that the next call to
+	 * report_free_pages() would report.
 	 */
-	void remove_block(PageDescriptor *pgd, int order)
+	uint64_t unreported_free_pages() const
 	{
-		// Starting from the _free_area array, iterate until the block has been located in the linked-list.
-		PageDescriptor **slot = &_free_areas[order];
-		while (*slot && pgd != *slot) 
+		settle_for_query();
+
+		uint64_t nr_pages = 0;
+		for (int order = _reporting_order; order <= MAX_ORDER; order++) 
 		{
-			slot = &(*slot)->next_free;
+			nr_pages += (_free_areas[order].nr_free - _free_areas[order].nr_reported) * pages_per_block(order);
 		}
 
-		// Make sure the block actually exists.  Panic the system if it does not.
-		assert(*slot == pgd);
-
-		// Remove the block from the free list.
-		*slot = pgd->next_free;
-		pgd->next_free = NULL;
+		return nr_pages;
 	}
 
 	/**
-	 * Given a pointer to a block of free memory in the order "source_order", this function will
-	 * split the block in half, and insert it into the order below.
-	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
-	 * @param source_order The order in which the block of free memory exists.  Naturally,
-	 * the split will insert the two new blocks into the order below.
-	 * @return Returns the left-hand-side of the new block.
+	 * Inflates the memory balloon, by taking free pages away from the allocator so that the host can use
+	 * them.  The largest free blocks are taken first, and blocks below BALLOON_MIN_ORDER are never
+	 * touched, so that ordinary allocations still find small blocks where they left them.  Each block
+	 * taken is handed to the reporting backend (if one is set), which tells the host about it.
+	 * @param nr_pages The number of pages to take.
+	 * @return Returns the number of pages taken, which is less than asked for if not enough memory is
+	 * free in large enough blocks (or without dipping into the reserve).
 	 */
-	PageDescriptor *split_block(PageDescriptor **block_pointer, int source_order)
+	uint64_t inflate(uint64_t nr_pages)
 	{
-		// Make sure there is an incoming pointer.
-		assert(*block_pointer);
+		LockGuard guard(_lock);
+		settle_memory_map();
 
-		// Make sure the area_pointer is correctly aligned.
-		assert(is_correct_alignment_for_order(*block_pointer, source_order));
+		uint64_t start = __builtin_ia32_rdtsc();
+		uint64_t remaining = nr_pages;
 
-		// if the order is 0, then we cannot split the block
-		if (source_order == 0) 
+		while (remaining > 0) 
 		{
-			return *block_pointer;
-		}
+			uint32_t candidates = _nonempty_orders & ~((1U << BALLOON_MIN_ORDER) - 1);
+			if (!candidates) break;
+
+			// take the largest free block, but split it down if it is more than is still needed
+			int free = 31 - __builtin_clz(candidates);
+			int target = 63 - __builtin_clzll(remaining);
+			if (target > free) target = free;
 
-        // get the left and right side of the block
-		PageDescriptor *left = *block_pointer;
-		PageDescriptor *right = left + pages_per_block(source_order - 1);
+			if (!within_reserve(target, AllocFlags::NONE)) break;
 
-		// remove the original block, and replace it with the split block at the lower order
-		remove_block(left, source_order);
-		insert_block(left, source_order - 1);
-		insert_block(right, source_order - 1);
+			// take blocks from the top of memory, away from ordinary allocations
+			PageDescriptor *block = mark_allocated(split_down(choose_block(free, PlacementPolicy::HIGHEST_ADDRESS), free, target), target);
+			block->next_free = _balloon;
+			_balloon = block;
+			_balloon_blocks++;
+			_balloon_pages += pages_per_block(target);
 
-		return *block_pointer;
+			if (_reporting_backend) _reporting_backend->report(sys.mm().pgalloc().pgd_to_pfn(block), pages_per_block(target));
+			remaining -= pages_per_block(target);
+		}
+
+		_balloon_inflated_pages += nr_pages - remaining;
+		_balloon_inflate_cycles += __builtin_ia32_rdtsc() - start;
+		return nr_pages - remaining;
 	}
 
 	/**
-	 * Takes a block in the given source order, and merges it (and its buddy) into the next order.
-	 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
-	 * @param source_order The order in which the pair of blocks live.
-	 * @return Returns the new slot that points to the merged block.
+	 * Deflates the memory balloon, by giving pages it holds back to the allocator.  Each block is
+	 * coalesced into the free lists straight away, so that large blocks re-form as soon as possible.
+	 * @param nr_pages The number of pages to give back.
+	 * @return Returns the number of pages given back, which is less than asked for only if the balloon
+	 * held fewer pages.
 	 */
-	PageDescriptor **merge_block(PageDescriptor **block_pointer, int source_order)
+	uint64_t deflate(uint64_t nr_pages)
 	{
-		// Make sure there is an incoming pointer.
-		assert(*block_pointer);
+		LockGuard guard(_lock);
+		settle_memory_map();
 
-		// Make sure the area_pointer is correctly aligned.
-		assert(is_correct_alignment_for_order(*block_pointer, source_order));
+		uint64_t start = __builtin_ia32_rdtsc();
+		uint64_t remaining = nr_pages;
 
-        // get the block and its buddy, and remove them
-		PageDescriptor *left = *block_pointer;
-		PageDescriptor *right = buddy_of(left, source_order);
-		remove_block(left, source_order);
-		remove_block(right, source_order);
-
-		// check for correct alignment, and insert the appropriately merged block at the higher order
-		if (is_correct_alignment_for_order(left, source_order + 1)) 
+		while (remaining > 0 && _balloon) 
 		{
-			return insert_block(left, source_order + 1);
+			PageDescriptor *block = _balloon;
+			_balloon = block->next_free;
+			_balloon_blocks--;
+			block->next_free = NULL;
+
+			int order = order_of(block);
+
+			// if the block is more than is still needed, keep its upper halves in the balloon
+			while (pages_per_block(order) > remaining) 
+			{
+				order--;
+
+				PageDescriptor *upper = block + pages_per_block(order);
+				_page_state[sys.mm().pgalloc().pgd_to_pfn(upper)] = PAGE_STATE_HEAD | order;
+				upper->next_free = _balloon;
+				_balloon = upper;
+				_balloon_blocks++;
+			}
+
+			_balloon_pages -= pages_per_block(order);
+			remaining -= pages_per_block(order);
+			free_block(block, order);
 		}
-		return insert_block(right, source_order + 1);
-		
+
+		// larger blocks may have formed, so complete waiting allocations and let the reserve pools recover
+		memory_freed();
+
+		_balloon_deflated_pages += nr_pages - remaining;
+		_balloon_deflate_cycles += __builtin_ia32_rdtsc() - start;
+		return nr_pages - remaining;
 	}
 
-public:
 	/**
-	 * Allocates 2^order number of contiguous pages
-	 * @param order The power of two, of the number of contiguous pages to allocate.
-	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
-	 * allocation failed.
+	 * Returns the number of pages currently held in the memory balloon.
 	 */
-	PageDescriptor *allocate_pages(int order) override
+	uint64_t balloon_pages() const
+	{
+		return _balloon_pages;
+	}
+
+	/**
+	 * Returns the number of bytes save_state() needs to save the current state of the allocator.  This does
+	 * not take the allocator lock, so the state may grow before save_state() is called (which checks again).
+	 */
+	uint64_t saved_state_size() const
 	{
-		int free;
-		for (free = order; free <= MAX_ORDER; free++) 
+		settle_for_query();
+
+		uint64_t nr_extents = _huge_pool_count + _gigantic_pool_count + _balloon_blocks;
+		for (int order = 0; order <= MAX_ORDER; order++) 
 		{
-			// if we have reached the max order, return null since allocation failed
-			if (free == MAX_ORDER && _free_areas[free] == NULL) return NULL;
-			// otherwise continue until the right order is found
-			else if (_free_areas[free] == NULL) continue;
-			// break when correct order is found
-			else break;
+			nr_extents += _free_areas[order].nr_free;
 		}
 
-		// go backwards and keep splitting the block
-		PageDescriptor* block = _free_areas[free];
-		for (int i = free; i > order; i--) 
+		// save_state() frees deferred blocks and cached pages first, and each of those adds at most one extent
+		nr_extents += __atomic_load_n(&_deferred_depth, __ATOMIC_RELAXED);
+		for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) 
 		{
-			block = split_block(&block, i);
+			nr_extents += _cpu_pages[cpu].count + __atomic_load_n(&_cpu_pages[cpu].inbox_depth, __ATOMIC_RELAXED);
 		}
 
-		// lastly, remove the block
-		remove_block(block, order);
-		return block;
+		return sizeof(SavedStateHeader) + (nr_extents * sizeof(uint64_t));
 	}
 
 	/**
-	* Helper function, repeatedly merges blocks until they can no longer be merged
-	* @param block_pointer A pointer to a pointer containing a block
-	* @param order The power of two, of the number of contiguous pages
-	*/
-	void repeated_merge(PageDescriptor **block_pointer, int order) 
+	 * Saves the free-extent state of the allocator into a reserved region, so that it can be restored
+	 * with restore_state() after a restart.  Blocks on the deferred-free queue and pages in the per-CPU
+	 * caches are given back to the free lists first, so every other CPU must have stopped allocating.
+	 * The reserve pools and the memory balloon are saved as they are.  Anything else not free at the time
+	 * of saving (including the region itself) stays allocated after the restore.
+	 * @param region A pointer to the region to save the state into.
+	 * @param size The size of the region, in bytes.
+	 * @return Returns the number of bytes written, or zero if the region was too small, or no memory has
+	 * been inserted yet.
+	 */
+	uint64_t save_state(void *region, uint64_t size)
 	{
-		// get the current slot (from parameter), current block for given order (from free areas) and the buddy of the current slot
-		int curr_order = order;
-		PageDescriptor **curr_block = block_pointer;
-		PageDescriptor *block = _free_areas[curr_order];
-		PageDescriptor *buddy = buddy_of(*curr_block, curr_order);
+		LockGuard guard(_lock);
+		settle_memory_map();
+
+		if (!_page_state) return 0;
 
-		// as long as we haven't reached max order and there are free areas in the current order
-		while (curr_order < MAX_ORDER && block) 
+		// only the free lists, pools and balloon are saved, so anything held elsewhere would be lost for good
+		drain_deferred_frees();
+		for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) 
 		{
-			// keep searching for a buddy in the free slots
-			if (block != buddy) 
-			{
-				block = block->next_free;
-			}
-			// if buddy is free, merge and move to a higher order
-			else 
+			take_remote_frees(_cpu_pages[cpu]);
+			trim_cpu_pages(_cpu_pages[cpu], _cpu_pages[cpu].count);
+		}
+
+		if (size < saved_state_size()) return 0;
+
+		SavedStateHeader *header = (SavedStateHeader *)region;
+		uint64_t *extents = (uint64_t *)(header + 1);
+		uint64_t nr_extents = 0;
+
+		// each order's extents are saved in free-list order (ascending, when the free lists are sorted)
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			for (const PageDescriptor *block = _free_areas[order].free_list; block; block = block->next_free) 
 			{
-				curr_block = merge_block(curr_block, curr_order++);
-				block = _free_areas[curr_order];
-				buddy = buddy_of(*curr_block, curr_order);
+				extents[nr_extents++] = pack_extent(block, order, SavedExtentKind::FREE);
 			}
 		}
 
+		for (const PageDescriptor *block = _huge_pool; block; block = block->next_free) 
+		{
+			extents[nr_extents++] = pack_extent(block, HUGE_PAGE_ORDER, SavedExtentKind::HUGE_POOL);
+		}
+
+		for (const PageDescriptor *block = _gigantic_pool; block; block = block->next_free) 
+		{
+			extents[nr_extents++] = pack_extent(block, GIGANTIC_PAGE_ORDER, SavedExtentKind::GIGANTIC_POOL);
+		}
+
+		// the host still has the balloon's pages, so they must not come back as free memory
+		for (const PageDescriptor *block = _balloon; block; block = block->next_free) 
+		{
+			extents[nr_extents++] = pack_extent(block, order_of(block), SavedExtentKind::BALLOON);
+		}
+
+		header->magic = SAVED_STATE_MAGIC;
+		header->version = SAVED_STATE_VERSION;
+		header->max_order = MAX_ORDER;
+		header->nr_page_descriptors = _nr_page_descriptors;
+		header->page_tables_pfn = sys.mm().pgalloc().pgd_to_pfn(_page_tables);
+		header->nr_extents = nr_extents;
+		header->checksum = checksum_extents(extents, nr_extents);
+
+		return sizeof(SavedStateHeader) + (nr_extents * sizeof(uint64_t));
 	}
 
-    /**
-	 * Frees 2^order contiguous pages.
-	 * @param pgd A pointer to an array of page descriptors to be freed.
-	 * @param order The power of two number of contiguous pages to free.
+	/**
+	 * Restores free-extent state saved by save_state(), in a single pass over the saved extents.  This
+	 * must be called on a freshly initialised allocator, instead of inserting the memory map.
+	 * @param region A pointer to the region holding the saved state.
+	 * @param size The size of the region, in bytes.
+	 * @return Returns TRUE if the state was restored, or FALSE if the region did not hold valid state for
+	 * this memory map, in which case the allocator is left empty and the caller should fall back to
+	 * inserting the memory map.
 	 */
-    void free_pages(PageDescriptor *pgd, int order) override
-    {
-		// Make sure that the incoming page descriptor is correctly aligned
-		// for the order on which it is being freed, for example, it is
-		// illegal to free page 1 in order-1.
-		assert(is_correct_alignment_for_order(pgd, order));
-		
-		// free requested block, and then continuously merge blocks until it is no longer possible
-		PageDescriptor **block = insert_block(pgd, order);
-		repeated_merge(block, order);
-    }
+	bool restore_state(const void *region, uint64_t size)
+	{
+		LockGuard guard(_lock);
 
-    /**
-     * Marks a range of pages as available for allocation.
-     * @param start A pointer to the first page descriptors to be made available.
-     * @param count The number of page descriptors to make available.
-     */
-    virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
-    {
-		while (count > 0) 
+		const SavedStateHeader *header = (const SavedStateHeader *)region;
+		const uint64_t *extents = (const uint64_t *)(header + 1);
+
+		// make sure the region holds state that was saved for this allocator, and has not been damaged
+		if (size < sizeof(SavedStateHeader)) return false;
+		if (header->magic != SAVED_STATE_MAGIC || header->version != SAVED_STATE_VERSION) return false;
+		if (header->max_order != MAX_ORDER || header->nr_page_descriptors != _nr_page_descriptors) return false;
+		if ((size - sizeof(SavedStateHeader)) / sizeof(uint64_t) < header->nr_extents) return false;
+		if (header->checksum != checksum_extents(extents, header->nr_extents)) return false;
+		if (header->page_tables_pfn > _nr_page_descriptors - page_table_pages()) return false;
+
+		// the per-page state tables go back where they were, since those pages were never saved as free.
+		// the saved state replaces anything inserted so far.
+		for (int i = 0; i <= MAX_ORDER; i++) _pending_blocks[i] = NULL;
+		place_page_tables(sys.mm().pgalloc().pfn_to_pgd(header->page_tables_pfn));
+
+		// each order's extents were saved in free-list order, so they can be appended to the free lists
+		PageDescriptor *tails[MAX_ORDER+1] = { NULL };
+
+		for (uint64_t i = 0; i < header->nr_extents; i++) 
 		{
-			int size;
-			for (size = MAX_ORDER; size >= 0; size--) 
+			pfn_t pfn = extents[i] >> 8;
+			int kind = (extents[i] >> 6) & 3;
+			int order = extents[i] & 63;
+			PageDescriptor *block = sys.mm().pgalloc().pfn_to_pgd(pfn);
+
+			// reject anything that could not have been saved from a consistent allocator
+			bool valid = (pfn + pages_per_block(order) <= _nr_page_descriptors) && is_correct_alignment_for_order(block, order);
+			switch (kind) 
 			{
-				// loop through all blocks until the correct range of pages is found
-				if (pages_per_block(size) > count || !is_correct_alignment_for_order(start, size)) continue;
-				else break;
+			case SavedExtentKind::FREE:
+				valid = valid && order <= MAX_ORDER && (!FreeList::sorted || !tails[order] || block > tails[order]);
+				break;
+			case SavedExtentKind::HUGE_POOL:
+				valid = valid && order == HUGE_PAGE_ORDER;
+				break;
+			case SavedExtentKind::GIGANTIC_POOL:
+				valid = valid && order == GIGANTIC_PAGE_ORDER;
+				break;
+			case SavedExtentKind::BALLOON:
+				valid = valid && order <= MAX_ORDER;
+				break;
+			default:
+				valid = false;
+				break;
 			}
 
-			// free all pages for that order
-			free_pages(start, size);
-			// and update the start and count
-			start += pages_per_block(size);
-			count -= pages_per_block(size);
+			if (!valid) 
+			{
+				init(_page_descriptors, _nr_page_descriptors);
+				return false;
+			}
+
+			if (kind == SavedExtentKind::FREE) 
+			{
+				// append the block to the end of its free list
+				block->next_free = NULL;
+				if (tails[order]) tails[order]->next_free = block;
+				else _free_areas[order].free_list = block;
+
+				tails[order] = block;
+				note_inserted(block, order);
+			}
+			else if (kind == SavedExtentKind::HUGE_POOL) 
+			{
+				block->next_free = _huge_pool;
+				_huge_pool = block;
+				_huge_pool_count++;
+			}
+			else if (kind == SavedExtentKind::GIGANTIC_POOL) 
+			{
+				block->next_free = _gigantic_pool;
+				_gigantic_pool = block;
+				_gigantic_pool_count++;
+			}
+			else 
+			{
+				// deflate() finds the order of a balloon block from its head page
+				mark_allocated(block, order);
+				block->next_free = _balloon;
+				_balloon = block;
+				_balloon_blocks++;
+				_balloon_pages += pages_per_block(order);
+			}
 		}
-    }
 
-    /**
-     * Marks a range of pages as unavailable for allocation.
-     * @param start A pointer to the first page descriptors to be made unavailable.
-     * @param count The number of page descriptors to make unavailable.
-     */
-    virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
-    {
-		// base case
-		if (count == 0) return;
+		return true;
+	}
 
-		// convert page descriptor for start of remove range to a numeric format
-		pfn_t start_as_pfn = sys.mm().pgalloc().pgd_to_pfn(start);
-		pfn_t end_as_pfn = start_as_pfn + count - 1;
+	/**
+	 * Returns the number of bytes take_snapshot() needs to snapshot the current state of the allocator.  This
+	 * does not take the allocator lock, so the state may grow before take_snapshot() is called (which checks
+	 * again).
+	 */
+	uint64_t snapshot_size() const
+	{
+		settle_for_query();
 
-		// loop through all possible orders top-down
-		for (uint32_t order = MAX_ORDER; order >= 0; order--) 
+		uint64_t nr_runs = 0;
+		for (int order = 0; order <= MAX_ORDER; order++) 
 		{
-			int curr_block_size = pages_per_block(order);
-			PageDescriptor *curr_block = _free_areas[order];
-
-			// as long as the block is not NULL
-			while (curr_block) 
+			const PageDescriptor *prev = NULL;
+			for (const PageDescriptor *block = _free_areas[order].free_list; block; block = block->next_free) 
 			{
-				// convert page descriptor for the current block to a numeric format
-				pfn_t block_start = sys.mm().pgalloc().pgd_to_pfn(curr_block);
-				pfn_t block_end = block_start + curr_block_size - 1;
-
-				// if this is the case, then we break, since the block does not contain the range at all
-				if (block_start > start_as_pfn) break;
+				// a new run starts whenever a block does not directly follow the previous one
+				if (!prev || block != prev + pages_per_block(order)) nr_runs++;
+				prev = block;
+			}
+		}
 
-				// if the block contains at least part of the range
-				if (block_start <= start_as_pfn && start_as_pfn <= block_end) 
-				{
-					// remove the whole block
-					remove_block(curr_block, order);
+		return sizeof(BuddySnapshotHeader) + (nr_runs * sizeof(BuddySnapshotRun));
+	}
 
-					PageDescriptor *left = sys.mm().pgalloc().pfn_to_pgd(block_start);
+	/**
+	 * Takes a compact snapshot of the free memory in the allocator, for offline fragmentation analysis
+	 * with the buddy-snapshot host tool.  Free blocks are run-length encoded, so that long stretches of
+	 * adjacent blocks of the same order take up a single entry.
+	 * @param buffer A pointer to the buffer to write the snapshot into.
+	 * @param size The size of the buffer, in bytes.
+	 * @param tag A caller-chosen value (e.g. a timestamp) recorded in the snapshot, to tell snapshots apart.
+	 * @return Returns the number of bytes written, or zero if the buffer was too small.
+	 */
+	uint64_t take_snapshot(void *buffer, uint64_t size, uint64_t tag) const
+	{
+		settle_for_query();
 
-					// if the range is fully contained in the block
-					if (end_as_pfn <= block_end) 
-					{
-						PageDescriptor *right = sys.mm().pgalloc().pfn_to_pgd(end_as_pfn + 1);
+		LockGuard guard(_lock);
 
-						// we re-add the parts of the block outside the remove range
-						insert_page_range(left, start_as_pfn - block_start);
-						insert_page_range(right, block_start + curr_block_size - end_as_pfn - 1);
-					}
+		if (size < snapshot_size()) return 0;
 
-					// if not fully contained, then the right side must be in a different block
-					else 
-					{
-						PageDescriptor *right = sys.mm().pgalloc().pfn_to_pgd(block_end + 1);
+		BuddySnapshotHeader *header = (BuddySnapshotHeader *)buffer;
+		BuddySnapshotRun *runs = (BuddySnapshotRun *)(header + 1);
+		uint64_t nr_runs = 0;
 
-						// so we insert the part on the left side that is outside the remove range
-						insert_page_range(left, start_as_pfn - block_start);
+		header->magic = BUDDY_SNAPSHOT_MAGIC;
+		header->version = BUDDY_SNAPSHOT_VERSION;
+		header->max_order = MAX_ORDER;
+		header->tag = tag;
+		header->nr_page_descriptors = _nr_page_descriptors;
+		header->huge_pool_pages = _huge_pool_count * pages_per_block(HUGE_PAGE_ORDER);
+		header->gigantic_pool_pages = _gigantic_pool_count * pages_per_block(GIGANTIC_PAGE_ORDER);
 
-						// and recurse to find the remaining part of the remove range
-						remove_page_range(right, count - (block_end - start_as_pfn + 1));
-					}
+		for (int order = 0; order <= BUDDY_SNAPSHOT_MAX_ORDER; order++) 
+		{
+			header->nr_free[order] = order <= MAX_ORDER ? _free_areas[order].nr_free : 0;
+		}
 
-					// if reached, it means block was found, so terminate the function
-					return;
+		// with sorted free lists, adjacent blocks of the same order follow each other in the list (without,
+		// the runs are still correct, just shorter)
+		for (int order = 0; order <= MAX_ORDER; order++) 
+		{
+			const PageDescriptor *prev = NULL;
+			for (const PageDescriptor *block = _free_areas[order].free_list; block; block = block->next_free) 
+			{
+				if (prev && block == prev + pages_per_block(order)) 
+				{
+					runs[nr_runs - 1].length++;
+				}
+				else 
+				{
+					runs[nr_runs].start_pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+					runs[nr_runs].order = order;
+					runs[nr_runs].length = 1;
+					nr_runs++;
 				}
 
-				// otherwise we move on to the next block
-				curr_block = curr_block->next_free;
+				prev = block;
 			}
-
 		}
 
-    }
+		header->nr_runs = nr_runs;
+		return sizeof(BuddySnapshotHeader) + (nr_runs * sizeof(BuddySnapshotRun));
+	}
 
 	/**
 	 * Initialises the allocation algorithm.
@@ -381,11 +3312,101 @@ public:
 		// when initialising, mark all blocks as free
         for (unsigned int i = 0; i <= MAX_ORDER; i++) 
 		{
-			_free_areas[i] = NULL;
+			_free_areas[i].free_list = NULL;
+			_free_areas[i].nr_free = 0;
+			_free_areas[i].nr_reported = 0;
+		}
+		_nr_free_pages = 0;
+		_nonempty_orders = 0;
+
+		_placement.reset();
+		_reserve_pages = DEFAULT_RESERVE_PAGES;
+		_stats.reset();
+
+		// the deferred-free queue starts empty
+		for (unsigned int i = 0; i <= MAX_ORDER; i++) 
+		{
+			_deferred_frees[i] = NULL;
+		}
+		_deferred_depth = 0;
+		_deferred_high_water = 0;
+		_deferred_batches = 0;
+
+		// no asynchronous allocations are waiting
+		for (unsigned int i = 0; i <= MAX_ORDER; i++) 
+		{
+			_waiting_requests[i] = NULL;
+		}
+		_waiting_orders = 0;
+		_async_queued = 0;
+		_async_completed = 0;
+		_async_cancelled = 0;
+
+		// every per-CPU page cache starts empty
+		for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) 
+		{
+			PerCpuPages& pcp = _cpu_pages[cpu];
+			pcp.free_list = NULL;
+			pcp.count = 0;
+			pcp.high = PCP_HIGH;
+			pcp.batch = PCP_BATCH;
+			pcp.allocations = 0;
+			pcp.local_frees = 0;
+			pcp.remote_frees = 0;
+			pcp.refills = 0;
+			pcp.trims = 0;
+			pcp.inbox_drains = 0;
+			pcp.inbox_pages = 0;
+			pcp.epoch_start = __builtin_ia32_rdtsc();
+			pcp.epoch_events = 0;
+			pcp.epoch_batches = 0;
+			pcp.grows = 0;
+			pcp.shrinks = 0;
+			pcp.idle_drains = 0;
+			pcp.inbox = NULL;
+			pcp.inbox_depth = 0;
 		}
 
+		// nothing is reported until a backend is set
+		_reporting_backend = NULL;
+		_reporting_order = DEFAULT_REPORTING_ORDER;
+		_report_passes = 0;
+		_report_blocks = 0;
+		_report_pages = 0;
+		_report_cycles = 0;
+
+		// the balloon starts empty
+		_balloon = NULL;
+		_balloon_blocks = 0;
+		_balloon_pages = 0;
+		_balloon_inflated_pages = 0;
+		_balloon_inflate_cycles = 0;
+		_balloon_deflated_pages = 0;
+		_balloon_deflate_cycles = 0;
+
+		// the huge-page pool starts empty, and fills up as memory is inserted
+		_huge_pool = NULL;
+		_huge_pool_count = 0;
+		_huge_pool_target = DEFAULT_HUGE_POOL_SIZE;
+
+		// gigantic pages are reserved as soon as enough memory has been inserted
+		_gigantic_pool = NULL;
+		_gigantic_pool_count = 0;
+		_gigantic_pool_target = BOOT_GIGANTIC_PAGES;
+
+		_page_descriptors = page_descriptors;
+		_nr_page_descriptors = nr_page_descriptors;
+
+		// the per-page state tables are placed in inserted memory once the memory map is settled
+		_page_tables = NULL;
+		_page_state = NULL;
+		_page_owner = NULL;
+		for (int i = 0; i <= MAX_ORDER; i++) _pending_blocks[i] = NULL;
+
 		// base condition to ensure the parameters are valid
-		return (page_descriptors && nr_page_descriptors > 0);
+		if (!page_descriptors || nr_page_descriptors == 0) return false;
+
+		return true;
 	}
 
 	/**
@@ -398,6 +3419,10 @@ public:
 	 */
 	void dump_state() const override
 	{
+		settle_for_query();
+
+		LockGuard guard(_lock);
+
 		// Print out a header, so we can find the output in the logs.
 		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
 
@@ -407,7 +3432,7 @@ public:
 			snprintf(buffer, sizeof(buffer), "[%d] ", i);
 
 			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
+			PageDescriptor *pg = _free_areas[i].free_list;
 			while (pg) {
 				// Append the PFN of the free block to the output buffer.
 				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
@@ -416,11 +3441,123 @@ public:
 
 			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
 		}
+
+		mm_log.messagef(LogLevel::DEBUG, "largest free order: %d", largest_free_order());
+		mm_log.messagef(LogLevel::DEBUG, "deferred frees: depth=%lu high-water=%lu batches=%lu",
+			deferred_free_depth(), deferred_free_high_water(), _deferred_batches);
+		mm_log.messagef(LogLevel::DEBUG, "huge pages: pool=%lu/%lu available=%lu",
+			_huge_pool_count, _huge_pool_target, huge_pages_available());
+		mm_log.messagef(LogLevel::DEBUG, "gigantic pages: pool=%lu/%lu",
+			_gigantic_pool_count, _gigantic_pool_target);
+		mm_log.messagef(LogLevel::DEBUG, "free page reporting: reported=%lu unreported=%lu passes=%lu blocks=%lu pages=%lu cycles=%lu",
+			reported_free_pages(), unreported_free_pages(), _report_passes, _report_blocks, _report_pages, _report_cycles);
+		mm_log.messagef(LogLevel::DEBUG, "async allocations: waiting-orders=%x queued=%lu completed=%lu cancelled=%lu",
+			_waiting_orders, _async_queued, _async_completed, _async_cancelled);
+		for (unsigned int cpu = 0; cpu < NR_CPUS; cpu++) 
+		{
+			const PerCpuPages& pcp = _cpu_pages[cpu];
+			if (!pcp.allocations && !pcp.local_frees && !pcp.remote_frees && !pcp.inbox_depth) continue;
+
+			mm_log.messagef(LogLevel::DEBUG, "cpu %u pages: cached=%lu/%lu batch=%lu allocs=%lu local-frees=%lu remote-frees=%lu refills=%lu trims=%lu inbox=%lu drains=%lu drained=%lu",
+				cpu, pcp.count, pcp.high, pcp.batch, pcp.allocations, pcp.local_frees, pcp.remote_frees, pcp.refills, pcp.trims,
+				__atomic_load_n(&pcp.inbox_depth, __ATOMIC_RELAXED), pcp.inbox_drains, pcp.inbox_pages);
+			mm_log.messagef(LogLevel::DEBUG, "cpu %u tuning: grows=%lu shrinks=%lu idle-drains=%lu",
+				cpu, pcp.grows, pcp.shrinks, pcp.idle_drains);
+		}
+		mm_log.messagef(LogLevel::DEBUG, "balloon: pages=%lu inflated=%lu (%lu cycles) deflated=%lu (%lu cycles)",
+			_balloon_pages, _balloon_inflated_pages, _balloon_inflate_cycles, _balloon_deflated_pages, _balloon_deflate_cycles);
+		_stats.dump();
 	}
 
 
 private:
-	PageDescriptor *_free_areas[MAX_ORDER+1];
+	FreeArea _free_areas[MAX_ORDER+1];
+
+	PageDescriptor *_page_descriptors;
+	uint64_t _nr_page_descriptors;
+
+	// the total number of pages on the free lists, and a bitmap with bit N set when order N is non-empty.
+	// Every insertion and removal writes these, at any order, so they are kept off the read-mostly line
+	// above.
+	__attribute__((aligned(CACHE_LINE_SIZE))) uint64_t _nr_free_pages;
+	uint32_t _nonempty_orders;
+
+	// huge pages held in reserve, linked through next_free.  The pools and settings are written far
+	// less often than the free areas, so they start on a cache line of their own.
+	__attribute__((aligned(CACHE_LINE_SIZE))) PageDescriptor *_huge_pool;
+	uint64_t _huge_pool_count;
+	uint64_t _huge_pool_target;
+
+	// gigantic pages held in reserve, linked through next_free
+	PageDescriptor *_gigantic_pool;
+	uint64_t _gigantic_pool_count;
+	uint64_t _gigantic_pool_target;
+
+	Placement _placement;
+	uint64_t _reserve_pages;
+	Stats _stats;
+
+	// serialises allocator operations.  Queries that only log or measure state take it too, so it is
+	// mutable.  Waiters spin on the lock while the holder writes the fields above, so it gets a cache
+	// line of its own.
+	__attribute__((aligned(CACHE_LINE_SIZE))) mutable Lock _lock;
+
+	// blocks waiting to be freed, one lock-free stack per order.  These are written from any context,
+	// so they are kept away from the rest of the allocator state.
+	__attribute__((aligned(CACHE_LINE_SIZE))) PageDescriptor *_deferred_frees[MAX_ORDER+1];
+	uint64_t _deferred_depth;
+	uint64_t _deferred_high_water;
+	uint64_t _deferred_batches;
+
+	// asynchronous allocations waiting for memory, one FIFO queue per order, and a bitmap with bit N set
+	// when order N has requests waiting
+	AllocationRequest *_waiting_requests[MAX_ORDER+1];
+	uint32_t _waiting_orders;
+	uint64_t _async_queued;
+	uint64_t _async_completed;
+	uint64_t _async_cancelled;
+
+	// free page reporting: the backend, the smallest order reported, and counters for measuring report
+	// throughput
+	FreePageReportingBackend *_reporting_backend;
+	int _reporting_order;
+	uint64_t _report_passes;
+	uint64_t _report_blocks;
+	uint64_t _report_pages;
+	uint64_t _report_cycles;
+
+	// blocks held in the memory balloon, linked through next_free (each head page records its order),
+	// and counters for measuring inflate and deflate speed
+	PageDescriptor *_balloon;
+	uint64_t _balloon_blocks;
+	uint64_t _balloon_pages;
+	uint64_t _balloon_inflated_pages;
+	uint64_t _balloon_inflate_cycles;
+	uint64_t _balloon_deflated_pages;
+	uint64_t _balloon_deflate_cycles;
+
+	// per-CPU page caches, each on cache lines of its own
+	PerCpuPages _cpu_pages[NR_CPUS];
+
+	// PageDescriptor has no room for allocator state, so it lives in tables of one byte per page,
+	// carved from inserted memory starting at _page_tables.  Until the memory map is settled, inserted
+	// memory waits untouched, as blocks on per-order lists in _pending_blocks.
+	PageDescriptor *_page_tables;
+	PageDescriptor *_pending_blocks[MAX_ORDER+1];
+
+	// per-page state, indexed by page-frame number
+	uint8_t *_page_state;
+
+	// the CPU whose page cache each page was last allocated from, indexed by page-frame number
+	uint8_t *_page_owner;
+};
+
+/**
+ * The buddy allocator as InfOS uses it: sorted free lists, no locking (the caller serialises allocator
+ * operations), no statistics, and a placement policy that can be changed at runtime.
+ */
+class BuddyPageAllocator : public BasicBuddyPageAllocator<SortedFreeList, NoLocking, NoStatistics, RuntimePlacement>
+{
 };
 
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
@@ -0,0 +1,530 @@
+/*
+ * The Real-Time Buddy Page Allocator
+ *
+ * A variant of the buddy page allocator with a bounded worst-case execution time.  Each order has a
+ * doubly linked free list, and the allocator keeps a bitmap of non-empty orders and a state byte for
+ * every page.  So allocate_pages() and free_pages() only ever do O(MAX_ORDER) constant-time steps,
+ * however many blocks are free.
+ */
+
+#include <infos/mm/page-allocator.h>
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/util/math.h>
+#include <infos/util/printf.h>
+
+using namespace infos::kernel;
+using namespace infos::mm;
+using namespace infos::util;
+
+#define MAX_ORDER	18
+
+// The size of a page, in bytes.
+#define BYTES_PER_PAGE	0x1000
+
+// Marks a page as the head of a free block.  The low bits of the page state hold the block's order.
+#define RT_PAGE_FREE	0x80
+
+// Terminates the backward links of the free lists.
+#define RT_NO_PFN	0xffffffffU
+
+/**
+ * Timing statistics for one kind of allocator operation, in CPU cycles.
+ */
+struct OperationTiming
+{
+	uint64_t count;
+	uint64_t total_cycles;
+	uint64_t max_cycles;
+};
+
+/**
+ * A buddy page allocation algorithm with bounded worst-case execution time.
+ */
+class RealTimeBuddyPageAllocator : public PageAllocatorAlgorithm
+{
+private:
+
+	/**
+	 * Returns the number of pages that comprise a 'block', in a given order.
+	 * @param order The order to base the calculation off of.
+	 * @return Returns the number of pages in a block, in the order.
+	 */
+	static inline constexpr uint64_t pages_per_block(int order)
+	{
+		return (1ULL << order);
+	}
+
+	/**
+	 * Returns TRUE if the supplied page descriptor is correctly aligned for the
+	 * given order.  Returns FALSE otherwise.
+	 * @param pgd The page descriptor to test alignment for.
+	 * @param order The order to use for calculations.
+	 */
+	static inline bool is_correct_alignment_for_order(const PageDescriptor *pgd, int order)
+	{
+		return (sys.mm().pgalloc().pgd_to_pfn(pgd) % pages_per_block(order)) == 0;
+	}
+
+	/**
+	 * Reads the CPU's cycle counter, for timing allocator operations.
+	 */
+	static inline uint64_t read_cycles()
+	{
+		return __builtin_ia32_rdtsc();
+	}
+
+	/**
+	 * Records how long an operation took.
+	 * @param timing The statistics to record the operation in.
+	 * @param start The cycle counter when the operation started.
+	 */
+	static inline void record_timing(OperationTiming& timing, uint64_t start)
+	{
+		uint64_t cycles = read_cycles() - start;
+
+		timing.count++;
+		timing.total_cycles += cycles;
+		if (cycles > timing.max_cycles) timing.max_cycles = cycles;
+	}
+
+	/**
+	 * Returns TRUE if the given page-frame number is the head of a free block of the given order.
+	 * @param pfn The page-frame number to check.
+	 * @param order The order the block must be free in.
+	 */
+	bool is_free_block(pfn_t pfn, int order) const
+	{
+		return pfn < _nr_pages && _page_state[pfn] == (RT_PAGE_FREE | order);
+	}
+
+	/**
+	 * Pushes a block onto the front of the free list of the given order, in O(1).
+	 * @param pgd The page descriptor of the block to insert.
+	 * @param order The order in which to insert the block.
+	 */
+	void push_block(PageDescriptor *pgd, int order)
+	{
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		PageDescriptor *head = _free_areas[order];
+
+		// link the block in front of the current head
+		pgd->next_free = head;
+		_prev[pfn] = RT_NO_PFN;
+		if (head) _prev[sys.mm().pgalloc().pgd_to_pfn(head)] = pfn;
+
+		_free_areas[order] = pgd;
+		_nr_free[order]++;
+		_nonempty_orders |= (1U << order);
+		_page_state[pfn] = RT_PAGE_FREE | order;
+	}
+
+	/**
+	 * Unlinks a block from the free list of the given order, in O(1).  The block MUST be present in the
+	 * free list, otherwise the system will panic.
+	 * @param pgd The page descriptor of the block to remove.
+	 * @param order The order in which to remove the block from.
+	 */
+	void unlink_block(PageDescriptor *pgd, int order)
+	{
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		assert(is_free_block(pfn, order));
+
+		// point the neighbours at each other
+		uint32_t prev = _prev[pfn];
+		PageDescriptor *next = pgd->next_free;
+		if (prev == RT_NO_PFN) _free_areas[order] = next;
+		else sys.mm().pgalloc().pfn_to_pgd(prev)->next_free = next;
+		if (next) _prev[sys.mm().pgalloc().pgd_to_pfn(next)] = prev;
+
+		pgd->next_free = NULL;
+		_page_state[pfn] = 0;
+
+		_nr_free[order]--;
+		if (!_free_areas[order]) _nonempty_orders &= ~(1U << order);
+	}
+
+	/**
+	 * Merges a block with its buddies for as long as they are free, and then pushes the final coalesced
+	 * block onto its free list.  Each step is O(1), so this is O(MAX_ORDER).
+	 * @param pgd The page descriptor of the block to coalesce.
+	 * @param order The order of the block.
+	 */
+	void coalesce_block(PageDescriptor *pgd, int order)
+	{
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+
+		// climb for as long as the buddy is the head of a free block of the current order
+		while (order < MAX_ORDER)
+		{
+			pfn_t buddy_pfn = pfn ^ pages_per_block(order);
+			if (!is_free_block(buddy_pfn, order)) break;
+
+			unlink_block(sys.mm().pgalloc().pfn_to_pgd(buddy_pfn), order);
+			pfn &= ~pages_per_block(order);
+			order++;
+		}
+
+		push_block(sys.mm().pgalloc().pfn_to_pgd(pfn), order);
+	}
+
+	/**
+	 * Returns the order of the largest correctly aligned block that starts a range of pages.
+	 * @param pfn The first page-frame number in the range.
+	 * @param count The number of pages in the range, which must not be zero.
+	 */
+	static int largest_block_order(pfn_t pfn, uint64_t count)
+	{
+		int order;
+		for (order = MAX_ORDER; order > 0; order--)
+		{
+			if (pages_per_block(order) <= count && (pfn % pages_per_block(order)) == 0) break;
+		}
+
+		return order;
+	}
+
+	/**
+	 * Splits a range of pages into the largest correctly aligned blocks possible, and coalesces each one
+	 * into the free lists.
+	 * @param pfn The first page-frame number in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void free_range(pfn_t pfn, uint64_t count)
+	{
+		while (count > 0)
+		{
+			int size = largest_block_order(pfn, count);
+
+			coalesce_block(sys.mm().pgalloc().pfn_to_pgd(pfn), size);
+			pfn += pages_per_block(size);
+			count -= pages_per_block(size);
+		}
+	}
+
+	/**
+	 * Returns the number of pages the per-page tables take up: a backward link and a state byte for every
+	 * page in the memory map.
+	 */
+	uint64_t page_table_pages() const
+	{
+		return ((sizeof(uint32_t) + sizeof(uint8_t)) * _nr_pages + BYTES_PER_PAGE - 1) / BYTES_PER_PAGE;
+	}
+
+	/**
+	 * Sets a range of pages aside until the memory map is settled, as the largest correctly aligned
+	 * blocks possible.  The blocks are linked through their page descriptors, so the pages themselves
+	 * are not touched.
+	 * @param pfn The first page-frame number in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void add_pending_range(pfn_t pfn, uint64_t count)
+	{
+		while (count > 0)
+		{
+			int order = largest_block_order(pfn, count);
+			PageDescriptor *block = sys.mm().pgalloc().pfn_to_pgd(pfn);
+
+			block->next_free = _pending_blocks[order];
+			_pending_blocks[order] = block;
+
+			pfn += pages_per_block(order);
+			count -= pages_per_block(order);
+		}
+	}
+
+	/**
+	 * Takes a range of pages out of the blocks waiting for the memory map to be settled.
+	 * @param pfn The first page-frame number in the range.
+	 * @param count The number of pages in the range.
+	 */
+	void remove_pending_range(pfn_t pfn, uint64_t count)
+	{
+		pfn_t end = pfn + count;
+
+		for (int order = 0; order <= MAX_ORDER; order++)
+		{
+			PageDescriptor **slot = &_pending_blocks[order];
+			while (*slot)
+			{
+				PageDescriptor *block = *slot;
+				pfn_t block_pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+				pfn_t block_end = block_pfn + pages_per_block(order);
+
+				if (block_end <= pfn || block_pfn >= end)
+				{
+					slot = &block->next_free;
+					continue;
+				}
+
+				// keep whatever lies on either side of the removed range, on lower orders' lists
+				*slot = block->next_free;
+				if (block_pfn < pfn) add_pending_range(block_pfn, pfn - block_pfn);
+				if (block_end > end) add_pending_range(end, block_end - end);
+			}
+		}
+	}
+
+	/**
+	 * Returns the order of the pending block that starts at a page, or -1 if no pending block does.
+	 * @param pfn The page-frame number to look for.
+	 */
+	int pending_block_order(pfn_t pfn) const
+	{
+		const PageDescriptor *pgd = sys.mm().pgalloc().pfn_to_pgd(pfn);
+
+		for (int order = 0; order <= MAX_ORDER; order++)
+		{
+			for (const PageDescriptor *block = _pending_blocks[order]; block; block = block->next_free)
+			{
+				if (block == pgd) return order;
+			}
+		}
+
+		return -1;
+	}
+
+	/**
+	 * Places the per-page tables in the lowest run of contiguous pending blocks that can hold them, and
+	 * frees the rest, the first time memory is allocated or freed.  Until then nothing inserted is written
+	 * to, so memory that was inserted and then reserved again is never clobbered.  Like
+	 * remove_page_range(), this is not bounded, but it only ever happens once.
+	 * @return Returns TRUE if the tables are in place.
+	 */
+	__attribute__((noinline)) bool settle_memory_map()
+	{
+		uint64_t table_pages = page_table_pages();
+		pfn_t tables = RT_NO_PFN;
+
+		for (int order = 0; order <= MAX_ORDER; order++)
+		{
+			for (PageDescriptor *block = _pending_blocks[order]; block; block = block->next_free)
+			{
+				pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+				if (pfn >= tables) continue;
+
+				// count the pages in the run of pending blocks that starts here
+				uint64_t run = 0;
+				int run_order;
+				while (run < table_pages && (run_order = pending_block_order(pfn + run)) >= 0) run += pages_per_block(run_order);
+
+				if (run >= table_pages) tables = pfn;
+			}
+		}
+
+		if (tables == RT_NO_PFN)
+		{
+			mm_log.messagef(LogLevel::ERROR, "rt-buddy: no inserted range can hold %lu pages of tables", table_pages);
+			return false;
+		}
+
+		remove_pending_range(tables, table_pages);
+
+		// the backward links come first, to keep them aligned, and only the state needs clearing
+		_prev = (uint32_t *)sys.mm().pgalloc().pgd_to_vpa(sys.mm().pgalloc().pfn_to_pgd(tables));
+		_page_state = (uint8_t *)(_prev + _nr_pages);
+		__builtin_memset(_page_state, 0, _nr_pages);
+
+		for (int order = 0; order <= MAX_ORDER; order++)
+		{
+			while (_pending_blocks[order])
+			{
+				PageDescriptor *block = _pending_blocks[order];
+				_pending_blocks[order] = block->next_free;
+				coalesce_block(block, order);
+			}
+		}
+
+		return true;
+	}
+
+public:
+	/**
+	 * Allocates 2^order number of contiguous pages, in O(MAX_ORDER) time.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages(int order) override
+	{
+		if (__builtin_expect(!_page_state, 0) && !settle_memory_map()) return NULL;
+
+		uint64_t start = read_cycles();
+		PageDescriptor *block = NULL;
+
+		// find the smallest non-empty order that can satisfy the request with a single bit scan
+		uint32_t candidates = (order >= 0 && order <= MAX_ORDER) ? _nonempty_orders & ~((1U << order) - 1) : 0;
+		if (candidates)
+		{
+			int free = __builtin_ctz(candidates);
+
+			// take the head of that order, and hand back the right-hand halves on the way down
+			block = _free_areas[free];
+			unlink_block(block, free);
+			for (int i = free - 1; i >= order; i--)
+			{
+				push_block(block + pages_per_block(i), i);
+			}
+		}
+
+		record_timing(_allocate_timing, start);
+		return block;
+	}
+
+	/**
+	 * Frees 2^order contiguous pages, in O(MAX_ORDER) time.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void free_pages(PageDescriptor *pgd, int order) override
+	{
+		assert(is_correct_alignment_for_order(pgd, order));
+
+		// nothing can have been allocated before the map was settled, but a caller may hand back memory
+		// it reserved itself
+		if (__builtin_expect(!_page_state, 0) && !settle_memory_map()) return;
+
+		uint64_t start = read_cycles();
+		coalesce_block(pgd, order);
+		record_timing(_free_timing, start);
+	}
+
+	/**
+	 * Marks a range of pages as available for allocation.
+	 * @param start A pointer to the first page descriptors to be made available.
+	 * @param count The number of page descriptors to make available.
+	 */
+	virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
+	{
+		// parts of the range may yet be reserved, so it waits untouched until the memory map is settled
+		if (!_page_state) add_pending_range(sys.mm().pgalloc().pgd_to_pfn(start), count);
+		else free_range(sys.mm().pgalloc().pgd_to_pfn(start), count);
+	}
+
+	/**
+	 * Marks a range of pages as unavailable for allocation.  This is only used while setting up the memory
+	 * map, so it is not bounded in the same way as allocation and freeing.
+	 * @param start A pointer to the first page descriptors to be made unavailable.
+	 * @param count The number of page descriptors to make unavailable.
+	 */
+	virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
+	{
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(start);
+		pfn_t end = pfn + count;
+
+		if (!_page_state)
+		{
+			remove_pending_range(pfn, count);
+			return;
+		}
+
+		while (pfn < end)
+		{
+			// find the free block containing this page, by checking the aligned head at each order
+			int order;
+			pfn_t block_pfn = pfn;
+			for (order = 0; order <= MAX_ORDER; order++)
+			{
+				block_pfn = pfn & ~(pages_per_block(order) - 1);
+				if (is_free_block(block_pfn, order)) break;
+			}
+
+			// the page is not free, so there is nothing to remove
+			if (order > MAX_ORDER)
+			{
+				pfn++;
+				continue;
+			}
+
+			// take the block out, and put back the parts of it either side of the range
+			pfn_t block_end = block_pfn + pages_per_block(order);
+			unlink_block(sys.mm().pgalloc().pfn_to_pgd(block_pfn), order);
+
+			free_range(block_pfn, pfn - block_pfn);
+			if (end < block_end) free_range(end, block_end - end);
+
+			pfn = block_end;
+		}
+	}
+
+	/**
+	 * Initialises the allocation algorithm.
+	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 */
+	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	{
+		// the backward links hold page-frame numbers in 32 bits
+		if (!page_descriptors || nr_page_descriptors == 0 || nr_page_descriptors >= RT_NO_PFN) return false;
+
+		for (unsigned int i = 0; i <= MAX_ORDER; i++)
+		{
+			_free_areas[i] = NULL;
+			_nr_free[i] = 0;
+			_pending_blocks[i] = NULL;
+		}
+
+		// the per-page tables are placed in inserted memory once the memory map is settled
+		_page_state = NULL;
+		_prev = NULL;
+
+		_nr_pages = nr_page_descriptors;
+		_nonempty_orders = 0;
+		_allocate_timing = OperationTiming();
+		_free_timing = OperationTiming();
+
+		return true;
+	}
+
+	/**
+	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "rt-buddy"; }
+
+	/**
+	 * Returns the timing statistics for allocate_pages(), including the worst case observed so far.
+	 */
+	const OperationTiming& allocate_timing() const { return _allocate_timing; }
+
+	/**
+	 * Returns the timing statistics for free_pages(), including the worst case observed so far.
+	 */
+	const OperationTiming& free_timing() const { return _free_timing; }
+
+	/**
+	 * Dumps out the current state of the allocator, along with the worst-case timings observed so far.
+	 */
+	void dump_state() const override
+	{
+		mm_log.messagef(LogLevel::DEBUG, "RT BUDDY STATE:");
+
+		for (unsigned int i = 0; i <= MAX_ORDER; i++) {
+			mm_log.messagef(LogLevel::DEBUG, "[%d] %lu free", i, _nr_free[i]);
+		}
+
+		mm_log.messagef(LogLevel::DEBUG, "allocate: count=%lu max=%lu cycles", _allocate_timing.count, _allocate_timing.max_cycles);
+		mm_log.messagef(LogLevel::DEBUG, "free: count=%lu max=%lu cycles", _free_timing.count, _free_timing.max_cycles);
+	}
+
+private:
+	PageDescriptor *_free_areas[MAX_ORDER+1];
+	uint64_t _nr_free[MAX_ORDER+1];
+
+	// bit N is set when the free list of order N is non-empty
+	uint32_t _nonempty_orders;
+
+	// per-page state, and the backward links of the free lists, indexed by page-frame number.  They are
+	// carved from inserted memory, which waits untouched in _pending_blocks until the map is settled.
+	uint64_t _nr_pages;
+	uint8_t *_page_state;
+	uint32_t *_prev;
+	PageDescriptor *_pending_blocks[MAX_ORDER+1];
+
+	OperationTiming _allocate_timing;
+	OperationTiming _free_timing;
+};
+
+/*
+ * Allocation algorithm registration framework
+ */
+RegisterPageAllocator(RealTimeBuddyPageAllocator);
@@ -0,0 +1,294 @@
+/*
+ * Buddy Allocator Snapshot Tool
+ *
+ * Loads snapshots written by BuddyPageAllocator::take_snapshot(), and either renders a
+ * fragmentation map of one snapshot, or shows what changed between two of them.
+ *
+ * Build on the host with:
+ *     g++ -O2 -I.. -o buddy-snapshot buddy-snapshot.cpp
+ *
+ * Usage:
+ *     buddy-snapshot map <snapshot>
+ *     buddy-snapshot diff <old snapshot> <new snapshot>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buddy-snapshot.h"
+
+// The number of cells in each row of a fragmentation map, and the number of rows to draw.
+#define MAP_COLUMNS	64
+#define MAP_ROWS	32
+
+// The most changed ranges a diff lists, before it just counts the rest.
+#define MAX_DIFF_RANGES	32
+
+/**
+ * A snapshot loaded from disk, along with a per-page map of which pages were free.
+ */
+struct Snapshot
+{
+	BuddySnapshotHeader header;
+	BuddySnapshotRun *runs;
+	uint8_t *free_map;
+};
+
+/**
+ * Loads a snapshot from a file, and expands its runs into a per-page free map.
+ * @param path The path of the snapshot file.
+ * @param snapshot The snapshot to load into.
+ * @return Returns TRUE if the snapshot was loaded, or FALSE (after printing why) otherwise.
+ */
+static bool load_snapshot(const char *path, Snapshot *snapshot)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "%s: unable to open\n", path);
+		return false;
+	}
+
+	// read and check the header
+	BuddySnapshotHeader *header = &snapshot->header;
+	if (fread(header, sizeof(*header), 1, file) != 1 || header->magic != BUDDY_SNAPSHOT_MAGIC)
+	{
+		fprintf(stderr, "%s: not a buddy allocator snapshot\n", path);
+		fclose(file);
+		return false;
+	}
+
+	if (header->version != BUDDY_SNAPSHOT_VERSION)
+	{
+		fprintf(stderr, "%s: unsupported snapshot version %u\n", path, header->version);
+		fclose(file);
+		return false;
+	}
+
+	// the per-order counters (and the loops over them) stop at the largest order the format can hold
+	if (header->max_order > BUDDY_SNAPSHOT_MAX_ORDER)
+	{
+		fprintf(stderr, "%s: unsupported maximum order %u\n", path, header->max_order);
+		fclose(file);
+		return false;
+	}
+
+	// read the runs
+	snapshot->runs = (BuddySnapshotRun *)calloc(header->nr_runs ? header->nr_runs : 1, sizeof(BuddySnapshotRun));
+	if (!snapshot->runs || fread(snapshot->runs, sizeof(BuddySnapshotRun), header->nr_runs, file) != header->nr_runs)
+	{
+		fprintf(stderr, "%s: snapshot is truncated\n", path);
+		free(snapshot->runs);
+		fclose(file);
+		return false;
+	}
+
+	fclose(file);
+
+	// expand the runs into a map with one byte per page
+	snapshot->free_map = (uint8_t *)calloc(header->nr_page_descriptors ? header->nr_page_descriptors : 1, 1);
+	if (!snapshot->free_map)
+	{
+		fprintf(stderr, "%s: memory map is too large\n", path);
+		free(snapshot->runs);
+		return false;
+	}
+
+	for (uint64_t i = 0; i < header->nr_runs; i++)
+	{
+		const BuddySnapshotRun *run = &snapshot->runs[i];
+		uint64_t nr_pages = (uint64_t)run->length << run->order;
+
+		if (run->order > header->max_order || run->start_pfn > header->nr_page_descriptors || nr_pages > header->nr_page_descriptors - run->start_pfn)
+		{
+			fprintf(stderr, "%s: run %lu lies outside the memory map\n", path, (unsigned long)i);
+			free(snapshot->free_map);
+			free(snapshot->runs);
+			return false;
+		}
+
+		memset(&snapshot->free_map[run->start_pfn], 1, nr_pages);
+	}
+
+	return true;
+}
+
+/**
+ * Returns the total number of free pages (outside the reserve pools) in a snapshot.
+ */
+static uint64_t free_pages(const Snapshot *snapshot)
+{
+	uint64_t total = 0;
+	for (uint32_t order = 0; order <= snapshot->header.max_order; order++)
+	{
+		total += snapshot->header.nr_free[order] << order;
+	}
+
+	return total;
+}
+
+/**
+ * Returns the largest order with at least one free block in a snapshot, or -1 if nothing is free.
+ */
+static int largest_free_order(const Snapshot *snapshot)
+{
+	for (int order = snapshot->header.max_order; order >= 0; order--)
+	{
+		if (snapshot->header.nr_free[order]) return order;
+	}
+
+	return -1;
+}
+
+/**
+ * Prints the counters held in a snapshot, along with a fragmentation index: the fraction of free
+ * memory that is not in the largest free block (0 means no fragmentation at all).
+ */
+static void print_summary(const char *path, const Snapshot *snapshot)
+{
+	const BuddySnapshotHeader *header = &snapshot->header;
+	uint64_t total = free_pages(snapshot);
+	int largest = largest_free_order(snapshot);
+
+	printf("%s: tag=%lu pages=%lu free=%lu huge-pool=%lu gigantic-pool=%lu\n", path,
+		(unsigned long)header->tag, (unsigned long)header->nr_page_descriptors, (unsigned long)total,
+		(unsigned long)header->huge_pool_pages, (unsigned long)header->gigantic_pool_pages);
+
+	for (uint32_t order = 0; order <= header->max_order; order++)
+	{
+		printf("  [%2u] %lu\n", order, (unsigned long)header->nr_free[order]);
+	}
+
+	if (largest >= 0)
+	{
+		printf("  largest free order: %d, fragmentation index: %.3f\n", largest,
+			1.0 - ((double)(1ULL << largest) / (double)total));
+	}
+}
+
+/**
+ * Renders a fragmentation map of a snapshot.  Each cell covers an equal share of the memory map, and
+ * shows how much of it is free: '.' for all free, '#' for all allocated or reserved, and a digit
+ * giving the free fraction in tenths otherwise.
+ */
+static void render_map(const Snapshot *snapshot)
+{
+	uint64_t nr_pages = snapshot->header.nr_page_descriptors;
+	uint64_t nr_cells = MAP_COLUMNS * MAP_ROWS;
+	uint64_t pages_per_cell = (nr_pages + nr_cells - 1) / nr_cells;
+
+	printf("  each cell is %lu pages\n", (unsigned long)pages_per_cell);
+
+	for (uint64_t row = 0; row < MAP_ROWS; row++)
+	{
+		uint64_t row_start = row * MAP_COLUMNS * pages_per_cell;
+		if (row_start >= nr_pages) break;
+
+		printf("  %10lx ", (unsigned long)row_start);
+		for (uint64_t column = 0; column < MAP_COLUMNS; column++)
+		{
+			uint64_t start = row_start + (column * pages_per_cell);
+			uint64_t end = start + pages_per_cell < nr_pages ? start + pages_per_cell : nr_pages;
+			if (start >= end) break;
+
+			uint64_t nr_free = 0;
+			for (uint64_t pfn = start; pfn < end; pfn++)
+			{
+				nr_free += snapshot->free_map[pfn];
+			}
+
+			if (nr_free == end - start) putchar('.');
+			else if (nr_free == 0) putchar('#');
+			else putchar('0' + (int)((nr_free * 10) / (end - start)));
+		}
+		putchar('\n');
+	}
+}
+
+/**
+ * Shows what changed between two snapshots of the same memory map: the change in the number of free
+ * blocks at each order, and the page ranges that were freed or allocated.
+ */
+static int diff_snapshots(const Snapshot *before, const Snapshot *after)
+{
+	if (before->header.nr_page_descriptors != after->header.nr_page_descriptors)
+	{
+		fprintf(stderr, "snapshots are of different memory maps\n");
+		return 1;
+	}
+
+	uint32_t max_order = before->header.max_order > after->header.max_order ? before->header.max_order : after->header.max_order;
+	printf("free blocks per order (old -> new):\n");
+	for (uint32_t order = 0; order <= max_order; order++)
+	{
+		uint64_t old_free = before->header.nr_free[order], new_free = after->header.nr_free[order];
+		if (old_free == new_free) continue;
+
+		printf("  [%2u] %lu -> %lu (%+ld)\n", order, (unsigned long)old_free, (unsigned long)new_free,
+			(long)(new_free - old_free));
+	}
+
+	printf("free pages: %lu -> %lu\n", (unsigned long)free_pages(before), (unsigned long)free_pages(after));
+
+	// walk both free maps together, and report each range of pages that changed state
+	uint64_t nr_pages = before->header.nr_page_descriptors;
+	uint64_t nr_ranges = 0;
+	uint64_t pfn = 0;
+	while (pfn < nr_pages)
+	{
+		if (before->free_map[pfn] == after->free_map[pfn])
+		{
+			pfn++;
+			continue;
+		}
+
+		uint64_t start = pfn;
+		uint8_t now_free = after->free_map[pfn];
+		while (pfn < nr_pages && before->free_map[pfn] != after->free_map[pfn] && after->free_map[pfn] == now_free)
+		{
+			pfn++;
+		}
+
+		if (nr_ranges++ < MAX_DIFF_RANGES)
+		{
+			printf("  %s %lx-%lx (%lu pages)\n", now_free ? "freed    " : "allocated",
+				(unsigned long)start, (unsigned long)(pfn - 1), (unsigned long)(pfn - start));
+		}
+	}
+
+	if (nr_ranges > MAX_DIFF_RANGES)
+	{
+		printf("  ... and %lu more ranges\n", (unsigned long)(nr_ranges - MAX_DIFF_RANGES));
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && strcmp(argv[1], "map") == 0)
+	{
+		Snapshot snapshot;
+		if (!load_snapshot(argv[2], &snapshot)) return 1;
+
+		print_summary(argv[2], &snapshot);
+		render_map(&snapshot);
+		return 0;
+	}
+
+	if (argc == 4 && strcmp(argv[1], "diff") == 0)
+	{
+		Snapshot before, after;
+		if (!load_snapshot(argv[2], &before) || !load_snapshot(argv[3], &after)) return 1;
+
+		print_summary(argv[2], &before);
+		print_summary(argv[3], &after);
+		return diff_snapshots(&before, &after);
+	}
+
+	fprintf(stderr, "usage: %s map <snapshot>\n", argv[0]);
+	fprintf(stderr, "       %s diff <old snapshot> <new snapshot>\n", argv[0]);
+	return 1;
+}
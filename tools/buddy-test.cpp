@@ -0,0 +1,495 @@
+/*
+ * Buddy Allocator Tests
+ *
+ * Drives the buddy page allocator on the host, against the stand-in kernel headers in tools/mock, and
+ * checks it on simulated memory maps of up to several GiB.  Memory is mapped without being reserved,
+ * so only the pages the allocator touches cost anything.
+ *
+ * Build on the host with:
+ *     g++ -O2 -I.. -Imock -o buddy-test buddy-test.cpp
+ *
+ * Usage:
+ *     buddy-test
+ */
+
+#define MOCK_KERNEL_INSTANCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../buddy.cpp"
+
+// A page of memory the allocator must never write to, until it is allocated.
+#define POISON	0x5a
+
+// The number of random operations each policy combination is put through.
+#define STRESS_OPERATIONS	20000
+
+// The most blocks the stress test holds at once.
+#define STRESS_BLOCKS	256
+
+// The order of the blocks a large map is handed out in.  Freeing into sorted lists is linear in their
+// length, so this keeps the number of blocks down.
+#define LARGE_MAP_ORDER	12
+
+static unsigned int failures;
+
+#define CHECK(_cond) do { if (!(_cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #_cond); failures++; } } while (0)
+
+/**
+ * Returns the page-frame number of a page descriptor, in the simulated memory map.
+ */
+static inline pfn_t pfn(const PageDescriptor *pgd)
+{
+	return sys.mm().pgalloc().pgd_to_pfn(pgd);
+}
+
+/**
+ * Returns the page descriptor of a page-frame number, in the simulated memory map.
+ */
+static inline PageDescriptor *pgd(pfn_t pfn)
+{
+	return sys.mm().pgalloc().pfn_to_pgd(pfn);
+}
+
+/**
+ * Returns TRUE if every byte of a run of pages still holds POISON.
+ */
+static bool is_poisoned(pfn_t start, uint64_t count)
+{
+	const uint8_t *bytes = (const uint8_t *)sys.mm().pgalloc().pgd_to_vpa(pgd(start));
+	for (uint64_t i = 0; i < count * BYTES_PER_PAGE; i++)
+	{
+		if (bytes[i] != POISON) return false;
+	}
+
+	return true;
+}
+
+/**
+ * A small xorshift generator, so that every run of the tests does the same thing.
+ */
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random()
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+/**
+ * Checks that memory inserted and then reserved again is never touched, however many ranges are
+ * inserted, and that the per-page tables end up in memory that survived.
+ */
+static void test_table_placement()
+{
+	uint64_t nr_pages = 1 << 16;
+	sys.mm().pgalloc().setup(nr_pages);
+	memset(sys.mm().pgalloc().pgd_to_vpa(pgd(0)), POISON, nr_pages * BYTES_PER_PAGE);
+
+	static BuddyPageAllocator allocator;
+	CHECK(allocator.init(pgd(0), nr_pages));
+
+	// far more small ranges than fit in any fixed table, then the bulk of memory, and then the
+	// reservations the kernel makes once the map is known: pfn 0, and its image at the start of the
+	// largest range
+	for (int i = 0; i < 40; i++) allocator.insert_page_range(pgd(1 + 3 * i), 2);
+	allocator.insert_page_range(pgd(1024), nr_pages - 1024);
+	allocator.remove_page_range(pgd(0), 1);
+	allocator.remove_page_range(pgd(1024), 512);
+	allocator.remove_page_range(pgd(2000), 3);
+	CHECK(is_poisoned(0, nr_pages));
+
+	// the first query settles the map
+	uint64_t table_pages = (2 * nr_pages + BYTES_PER_PAGE - 1) / BYTES_PER_PAGE;
+	CHECK(allocator.free_pages_total() == 40 * 2 + (nr_pages - 1024) - 512 - 3 - table_pages);
+	CHECK(is_poisoned(1024, 512));
+	CHECK(is_poisoned(2000, 3));
+
+	// nothing reserved is ever handed out, and nothing is handed out twice
+	uint8_t *seen = (uint8_t *)calloc(nr_pages, 1);
+	uint64_t nr_allocated = 0;
+	while (PageDescriptor *page = allocator.allocate_pages(0))
+	{
+		pfn_t n = pfn(page);
+		CHECK(n != 0 && !(n >= 1024 && n < 1536) && !(n >= 2000 && n < 2003) && !seen[n]);
+		seen[n] = 1;
+		nr_allocated++;
+	}
+	CHECK(nr_allocated == 40 * 2 + (nr_pages - 1024) - 512 - 3 - table_pages);
+	free(seen);
+
+	// no inserted range can hold the tables, so nothing is settled, until one that can is inserted
+	nr_pages = 1 << 20;
+	table_pages = (2 * nr_pages + BYTES_PER_PAGE - 1) / BYTES_PER_PAGE;
+	sys.mm().pgalloc().setup(nr_pages);
+	CHECK(allocator.init(pgd(0), nr_pages));
+
+	allocator.insert_page_range(pgd(3), 300);
+	allocator.insert_page_range(pgd(303), 200);
+	CHECK(allocator.allocate_pages(0) == NULL);
+	CHECK(allocator.free_pages_total() == 0);
+
+	// the tables may span adjacent ranges, as long as they are contiguous
+	allocator.insert_page_range(pgd(503), 100);
+	CHECK(allocator.free_pages_total() == 600 - table_pages);
+	allocator.insert_page_range(pgd(4096), nr_pages - 4096);
+	CHECK(allocator.free_pages_total() == 600 - table_pages + nr_pages - 4096);
+}
+
+/**
+ * Checks that a multi-GiB map, with holes, can be handed out entirely and coalesces back into the
+ * same blocks, and that blocks above MAX_ORDER are built from aligned runs of max-order blocks.
+ */
+static void test_large_map()
+{
+	// 16 GiB of 4 KiB pages, with a hole below 1 MiB and one in the middle
+	uint64_t nr_pages = 1ULL << 22;
+	sys.mm().pgalloc().setup(nr_pages);
+
+	static BuddyPageAllocator allocator;
+	CHECK(allocator.init(pgd(0), nr_pages));
+	allocator.insert_page_range(pgd(1), 159);
+	allocator.insert_page_range(pgd(256), nr_pages - 256);
+	allocator.remove_page_range(pgd(nr_pages / 2 + 1000), 70000);
+
+	uint64_t total = allocator.free_pages_total();
+	uint64_t blocks[MAX_ORDER+1];
+	for (int order = 0; order <= MAX_ORDER; order++) blocks[order] = allocator.free_blocks(order);
+
+	// take everything as 16 MiB blocks (and whatever is left over at lower orders), and give it back
+	// in a scrambled order
+	uint64_t nr_held = 0;
+	uint64_t max_held = (total >> LARGE_MAP_ORDER) + 4096;
+	PageDescriptor **held = (PageDescriptor **)malloc(sizeof(PageDescriptor *) * max_held);
+	int *orders = (int *)malloc(sizeof(int) * max_held);
+	for (int order = LARGE_MAP_ORDER; order >= 0; order--)
+	{
+		while (PageDescriptor *block = allocator.allocate_pages(order))
+		{
+			CHECK(pfn(block) % (1ULL << order) == 0 && nr_held < max_held);
+			if (nr_held == max_held) break;
+
+			held[nr_held] = block;
+			orders[nr_held++] = order;
+		}
+	}
+	CHECK(allocator.free_pages_total() == 0);
+
+	for (uint64_t i = nr_held - 1; i > 0; i--)
+	{
+		uint64_t j = next_random() % (i + 1);
+		PageDescriptor *block = held[i]; held[i] = held[j]; held[j] = block;
+		int order = orders[i]; orders[i] = orders[j]; orders[j] = order;
+	}
+	for (uint64_t i = 0; i < nr_held; i++) allocator.free_pages(held[i], orders[i]);
+
+	CHECK(allocator.free_pages_total() == total);
+	for (int order = 0; order <= MAX_ORDER; order++) CHECK(allocator.free_blocks(order) == blocks[order]);
+	free(held);
+	free(orders);
+
+	// a block above MAX_ORDER must start on a boundary of its own order.  there are four order-20
+	// boundaries: the first run is missing pfn 0 (and holds the tables), and the third runs into the
+	// hole, so only the second and fourth can be handed out
+	int order = MAX_ORDER + 2;
+	PageDescriptor *first = allocator.allocate_pages(order);
+	PageDescriptor *second = allocator.allocate_pages(order);
+	CHECK(first && pfn(first) == 1ULL << order);
+	CHECK(second && pfn(second) == 3ULL << order);
+	CHECK(allocator.allocate_pages(order) == NULL);
+	CHECK(allocator.order_of(first) == order);
+	CHECK(allocator.free_pages_total() == total - (2ULL << order));
+
+	// both go back as whole max-order blocks
+	allocator.free_pages(first, order);
+	allocator.free_pages(second, order);
+	CHECK(allocator.free_pages_total() == total);
+	for (int i = 0; i <= MAX_ORDER; i++) CHECK(allocator.free_blocks(i) == blocks[i]);
+
+	// with one max-order block taken out of the second run, only the fourth is left
+	PageDescriptor *taken[64];
+	int nr_taken = 0;
+	while (nr_taken < 64 && (taken[nr_taken] = allocator.allocate_pages(MAX_ORDER)) != NULL)
+	{
+		if (pfn(taken[nr_taken++]) == 1ULL << order) break;
+	}
+	CHECK(nr_taken > 0 && pfn(taken[nr_taken - 1]) == 1ULL << order);
+	for (int i = 0; i < nr_taken - 1; i++) allocator.free_pages(taken[i], MAX_ORDER);
+
+	first = allocator.allocate_pages(order);
+	CHECK(first && pfn(first) == 3ULL << order);
+	CHECK(allocator.allocate_pages(order) == NULL);
+}
+
+/**
+ * Checks freeing each part of an allocated block: the head, the tail, the middle, and unaligned runs.
+ */
+static void test_free_partial()
+{
+	uint64_t nr_pages = 1 << 16;
+	sys.mm().pgalloc().setup(nr_pages);
+
+	static BuddyPageAllocator allocator;
+	CHECK(allocator.init(pgd(0), nr_pages));
+	allocator.insert_page_range(pgd(0), nr_pages);
+	uint64_t total = allocator.free_pages_total();
+	uint64_t blocks[MAX_ORDER+1];
+	for (int order = 0; order <= MAX_ORDER; order++) blocks[order] = allocator.free_blocks(order);
+
+	// the head goes first: the block's first page is free, and the rest stays allocated
+	PageDescriptor *block = allocator.allocate_pages(4);
+	CHECK(allocator.order_of(block) == 4);
+	allocator.free_partial(block, 4, 0, 3);
+	CHECK(allocator.is_free(pfn(block)) && allocator.is_free(pfn(block) + 2) && !allocator.is_free(pfn(block) + 3));
+	CHECK(allocator.order_of(block) == -1);
+	allocator.free_partial(block, 4, 3, 13);
+	CHECK(allocator.free_pages_total() == total);
+
+	// the tail goes first: the head is still allocated, but no longer claims the whole block
+	block = allocator.allocate_pages(4);
+	allocator.free_partial(block, 4, 5, 11);
+	CHECK(!allocator.is_free(pfn(block) + 4) && allocator.is_free(pfn(block) + 5) && allocator.is_free(pfn(block) + 15));
+	CHECK(allocator.order_of(block) == -1);
+	CHECK(allocator.free_pages_total() == total - 5);
+	allocator.free_partial(block, 4, 0, 5);
+	CHECK(allocator.free_pages_total() == total);
+
+	// the middle goes first, then each end
+	block = allocator.allocate_pages(5);
+	allocator.free_partial(block, 5, 7, 13);
+	CHECK(!allocator.is_free(pfn(block) + 6) && allocator.is_free(pfn(block) + 7) && !allocator.is_free(pfn(block) + 20));
+	allocator.free_partial(block, 5, 20, 12);
+	allocator.free_partial(block, 5, 0, 7);
+	CHECK(allocator.free_pages_total() == total);
+
+	// freeing nothing leaves the block intact
+	block = allocator.allocate_pages(3);
+	allocator.free_partial(block, 3, 2, 0);
+	CHECK(allocator.order_of(block) == 3);
+	allocator.free_pages(block, 3);
+
+	// everything coalesced back into the blocks it came from
+	for (int order = 0; order <= MAX_ORDER; order++) CHECK(allocator.free_blocks(order) == blocks[order]);
+}
+
+/**
+ * Puts one combination of policies through a random mix of allocations and frees, checking that no
+ * page is handed out twice, that the free-page count stays right, and that everything coalesces back.
+ */
+template<class Allocator>
+static void stress(Allocator& allocator, uint64_t nr_pages)
+{
+	uint8_t *owner = (uint8_t *)calloc(nr_pages, 1);
+	PageDescriptor *blocks[STRESS_BLOCKS] = { NULL };
+	int orders[STRESS_BLOCKS];
+	uint64_t total = allocator.free_pages_total();
+	uint64_t max_order_blocks = allocator.free_blocks(MAX_ORDER);
+	uint64_t allocated = 0;
+
+	for (int i = 0; i < STRESS_OPERATIONS; i++)
+	{
+		int slot = next_random() % STRESS_BLOCKS;
+
+		if (blocks[slot])
+		{
+			for (uint64_t page = 0; page < (1ULL << orders[slot]); page++) owner[pfn(blocks[slot]) + page] = 0;
+			allocator.free_pages(blocks[slot], orders[slot]);
+			allocated -= 1ULL << orders[slot];
+			blocks[slot] = NULL;
+		}
+		else
+		{
+			int order = next_random() % 8;
+			PageDescriptor *block = allocator.allocate_pages(order);
+			if (!block) continue;
+
+			CHECK(pfn(block) % (1ULL << order) == 0);
+			for (uint64_t page = 0; page < (1ULL << order); page++)
+			{
+				CHECK(!owner[pfn(block) + page]);
+				owner[pfn(block) + page] = 1;
+			}
+
+			blocks[slot] = block;
+			orders[slot] = order;
+			allocated += 1ULL << order;
+		}
+
+		CHECK(allocator.free_pages_total() == total - allocated);
+	}
+
+	for (int slot = 0; slot < STRESS_BLOCKS; slot++)
+	{
+		if (blocks[slot]) allocator.free_pages(blocks[slot], orders[slot]);
+	}
+
+	CHECK(allocator.free_pages_total() == total);
+	CHECK(allocator.free_blocks(MAX_ORDER) == max_order_blocks);
+	free(owner);
+}
+
+/**
+ * Checks which block each placement policy hands out, with two free order-0 blocks.
+ */
+template<class FreeList, class Lock, class Stats>
+static void test_placement(BasicBuddyPageAllocator<FreeList, Lock, Stats, RuntimePlacement>& allocator)
+{
+	// the first pass frees the higher block last, and the second the lower one
+	for (int pass = 0; pass < 2; pass++)
+	{
+		allocator.set_placement_policy(PlacementPolicy::LIST_HEAD);
+
+		// 128 pages use up a whole order-7 block, so only the two freed below are left at order 0, and
+		// with their buddies still allocated they cannot coalesce
+		PageDescriptor *held[128];
+		for (int i = 0; i < 128; i++) held[i] = allocator.allocate_pages(0);
+		CHECK(allocator.free_blocks(0) == 0);
+
+		PageDescriptor *low = held[0], *high = held[0];
+		for (int i = 0; i < 128; i++)
+		{
+			if (held[i] < low) low = held[i];
+			if (held[i] > high) high = held[i];
+		}
+		low += 2;
+		high -= 2;
+
+		PageDescriptor *last_freed = pass == 0 ? high : low;
+		allocator.free_pages(pass == 0 ? low : high, 0);
+		allocator.free_pages(last_freed, 0);
+		CHECK(allocator.free_blocks(0) == 2);
+
+		// a sorted list has the lowest address at its head, and the others the block freed last
+		PageDescriptor *block = allocator.allocate_pages(0);
+		CHECK(block == (FreeList::sorted ? low : last_freed));
+		allocator.free_pages(block, 0);
+
+		allocator.set_placement_policy(PlacementPolicy::LOWEST_ADDRESS);
+		block = allocator.allocate_pages(0);
+		CHECK(block == low);
+		allocator.free_pages(block, 0);
+
+		allocator.set_placement_policy(PlacementPolicy::HIGHEST_ADDRESS);
+		block = allocator.allocate_pages(0);
+		CHECK(block == high);
+		allocator.free_pages(block, 0);
+
+		// the two probe pages are already free
+		for (int i = 0; i < 128; i++)
+		{
+			if (held[i] != low && held[i] != high) allocator.free_pages(held[i], 0);
+		}
+	}
+}
+
+/**
+ * Runs the placement checks and the stress test on one combination of free-list, locking and statistics
+ * policies, with each runtime placement policy, and with a placement fixed at compile time.
+ */
+template<class FreeList, class Lock, class Stats>
+static void test_combination(const char *name)
+{
+	uint64_t nr_pages = 1 << 20;
+	sys.mm().pgalloc().setup(nr_pages);
+
+	static BasicBuddyPageAllocator<FreeList, Lock, Stats, RuntimePlacement> allocator;
+	CHECK(allocator.init(pgd(0), nr_pages));
+	allocator.insert_page_range(pgd(0), nr_pages);
+
+	unsigned int before = failures;
+	test_placement(allocator);
+
+	const PlacementPolicy::PlacementPolicy policies[] = {
+		PlacementPolicy::LIST_HEAD, PlacementPolicy::LOWEST_ADDRESS, PlacementPolicy::HIGHEST_ADDRESS, PlacementPolicy::BUDDY_ALLOCATED,
+	};
+	for (unsigned int i = 0; i < ARRAY_SIZE(policies); i++)
+	{
+		allocator.set_placement_policy(policies[i]);
+		stress(allocator, nr_pages);
+	}
+
+	static BasicBuddyPageAllocator<FreeList, Lock, Stats, FixedPlacement<PlacementPolicy::BUDDY_ALLOCATED> > fixed;
+	CHECK(fixed.init(pgd(0), nr_pages));
+	fixed.insert_page_range(pgd(0), nr_pages);
+	stress(fixed, nr_pages);
+
+	printf("  %-40s %s\n", name, failures == before ? "ok" : "FAILED");
+}
+
+/**
+ * Checks that a NO_WAIT allocation fails, rather than spinning, while the allocator lock is held.
+ */
+static void test_no_wait()
+{
+	uint64_t nr_pages = 1 << 12;
+	sys.mm().pgalloc().setup(nr_pages);
+
+	static BasicBuddyPageAllocator<SortedFreeList, SpinLocking, NoStatistics, RuntimePlacement> allocator;
+	CHECK(allocator.init(pgd(0), nr_pages));
+	allocator.insert_page_range(pgd(0), nr_pages);
+	CHECK(allocator.free_pages_total() == nr_pages - 2);
+
+	// a free-page report callback runs with the lock held, so it stands in for an interrupted holder
+	struct HoldingBackend : public FreePageReportingBackend
+	{
+		BasicBuddyPageAllocator<SortedFreeList, SpinLocking, NoStatistics, RuntimePlacement> *allocator;
+		PageDescriptor *result;
+		bool called;
+
+		void report(pfn_t start_pfn, uint64_t nr_pages) override
+		{
+			if (called) return;
+			called = true;
+			result = allocator->allocate_pages(0, AllocFlags::NO_WAIT);
+		}
+	} backend;
+	backend.allocator = &allocator;
+	backend.result = NULL;
+	backend.called = false;
+
+	allocator.set_reporting_backend(&backend, 0);
+	allocator.report_free_pages();
+	CHECK(backend.called && backend.result == NULL);
+	allocator.set_reporting_backend(NULL, 0);
+
+	PageDescriptor *page = allocator.allocate_pages(0, AllocFlags::NO_WAIT);
+	CHECK(page != NULL);
+	allocator.free_pages(page, 0);
+}
+
+int main(int argc, char **argv)
+{
+	printf("table placement\n");
+	test_table_placement();
+
+	printf("large map\n");
+	test_large_map();
+
+	printf("partial frees\n");
+	test_free_partial();
+
+	printf("policy combinations\n");
+	test_combination<SortedFreeList, NoLocking, NoStatistics>("sorted, no locking, no statistics");
+	test_combination<SortedFreeList, SpinLocking, CountingStatistics>("sorted, spinlock, counting");
+	test_combination<LifoFreeList, NoLocking, CountingStatistics>("lifo, no locking, counting");
+	test_combination<LifoFreeList, SpinLocking, NoStatistics>("lifo, spinlock, no statistics");
+	test_combination<ShuffledFreeList, NoLocking, NoStatistics>("shuffled, no locking, no statistics");
+	test_combination<ShuffledFreeList, SpinLocking, CountingStatistics>("shuffled, spinlock, counting");
+
+	printf("no-wait allocations\n");
+	test_no_wait();
+
+	if (failures)
+	{
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+
+	printf("all tests passed\n");
+	return 0;
+}
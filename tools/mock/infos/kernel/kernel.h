@@ -0,0 +1,28 @@
+/*
+ * Host stand-in for the InfOS kernel object.  Define MOCK_KERNEL_INSTANCE in exactly one translation
+ * unit to instantiate it.
+ */
+#pragma once
+
+#include <infos/mm/mm.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Kernel
+		{
+		public:
+			infos::mm::MemoryManager& mm() { return _mm; }
+
+		private:
+			infos::mm::MemoryManager _mm;
+		};
+
+		extern Kernel sys;
+	}
+}
+
+#ifdef MOCK_KERNEL_INSTANCE
+infos::kernel::Kernel infos::kernel::sys;
+#endif
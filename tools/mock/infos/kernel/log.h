@@ -0,0 +1,51 @@
+/*
+ * Host stand-in for InfOS logging.  Warnings and errors are always printed; anything less severe is
+ * only printed if MOCK_VERBOSE is set in the environment.
+ */
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace LogLevel
+		{
+			enum LogLevel
+			{
+				DEBUG,
+				INFO,
+				WARNING,
+				ERROR,
+				FATAL,
+			};
+		}
+
+		class ComponentLog
+		{
+		public:
+			void messagef(LogLevel::LogLevel level, const char *format, ...) __attribute__((format(printf, 3, 4)))
+			{
+				if (level < LogLevel::WARNING && !getenv("MOCK_VERBOSE")) return;
+
+				va_list args;
+				va_start(args, format);
+				vprintf(format, args);
+				va_end(args);
+				printf("\n");
+			}
+		};
+	}
+
+	namespace mm
+	{
+		extern infos::kernel::ComponentLog mm_log;
+	}
+}
+
+#ifdef MOCK_KERNEL_INSTANCE
+infos::kernel::ComponentLog infos::mm::mm_log;
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Host stand-in for the InfOS page allocator interface, so that the allocators can be built and
+ * tested outside the kernel.  Physical memory is an anonymous mapping, and page-frame number n is
+ * page descriptor n of an array set up by PageAllocator::setup().
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+typedef uint64_t pfn_t;
+typedef uint64_t phys_addr_t;
+
+namespace infos
+{
+	namespace mm
+	{
+		struct PageDescriptor
+		{
+			PageDescriptor *next_free;
+			uint64_t flags;
+		};
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *allocate_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual void insert_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual void remove_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator
+		{
+		public:
+			/**
+			 * Maps page descriptors and page memory for a memory map of the given size, replacing any map
+			 * set up before.  The mappings are not reserved, so multi-GiB maps only cost the pages that are
+			 * touched.
+			 */
+			void setup(uint64_t nr_pages)
+			{
+				if (_base) 
+				{
+					munmap(_base, _nr_pages * sizeof(PageDescriptor));
+					munmap(_memory, _nr_pages << 12);
+				}
+
+				_base = (PageDescriptor *)mmap(NULL, nr_pages * sizeof(PageDescriptor), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				_memory = (uint8_t *)mmap(NULL, nr_pages << 12, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				assert(_base != MAP_FAILED && _memory != MAP_FAILED);
+				_nr_pages = nr_pages;
+			}
+
+			PageDescriptor *base() const { return _base; }
+			uint64_t nr_pages() const { return _nr_pages; }
+
+			pfn_t pgd_to_pfn(const PageDescriptor *pgd) const { return pgd - _base; }
+			PageDescriptor *pfn_to_pgd(pfn_t pfn) const { return _base + pfn; }
+			phys_addr_t pgd_to_pa(const PageDescriptor *pgd) const { return pgd_to_pfn(pgd) << 12; }
+			void *pgd_to_vpa(const PageDescriptor *pgd) const { return _memory + (pgd_to_pfn(pgd) << 12); }
+
+		private:
+			PageDescriptor *_base;
+			uint8_t *_memory;
+			uint64_t _nr_pages;
+		};
+	}
+}
+
+// Each registered algorithm becomes a global, named __pa_<class>, for the tests to drive.
+#define RegisterPageAllocator(_class) _class __pa_##_class
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for InfOS maths helpers.
+ */
+#pragma once
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+namespace infos
+{
+	namespace util
+	{
+	}
+}
@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for InfOS formatted printing.
+ */
+#pragma once
+
+#include <stdio.h>